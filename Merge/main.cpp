@@ -0,0 +1,12 @@
+#include <stdio.h>
+#include "SpUnit.h"
+
+using namespace SparrowUnit;
+
+/* Has no case, writes the results of shard runs to one report:
+       SparrowUnitMerge --merge=a.bin,b.bin --gtest_output=xml:all.xml */
+int main(int argc, char* argv[])
+{
+    SpUnitInit(argc, argv);
+    return SpUnitRunAll();
+}
@@ -1,5 +1,8 @@
 
 #include <stdio.h>
+#include <string.h>
+#include <map>
+#include <vector>
 #include "SpUnit.h"
 
 using namespace SparrowUnit;
@@ -88,6 +91,75 @@ TEST_F(SuiteTest, Test_add_function)
     EXPECT_EQ(2, Add(1,1));
 }
 
+TEST(BulkTest, Memory_and_array)
+{
+    char abBuf1[256], abBuf2[256];
+    int  aiSum[64], aiExpect[64];
+    for (int i=0; i<256; i++)
+        abBuf1[i] = abBuf2[i] = (char)i;
+    for (int i=0; i<64; i++) {
+        aiSum[i] = Add(i, 1);
+        aiExpect[i] = i+1;
+    }
+
+    EXPECT_MEMEQ(abBuf1, abBuf2, sizeof(abBuf1));
+    EXPECT_ARRAY_EQ(aiSum, aiExpect, 64);
+    EXPECT_CONTAINER_EQ(std::vector<int>(aiSum, aiSum+64), std::vector<int>(aiExpect, aiExpect+64));
+}
+
+/* Containers without contiguous storage are walked with iterators, pairs
+   cannot be streamed so a mismatch only reports its index */
+TEST(BulkTest, Container_map_and_bit_vector)
+{
+    std::map<int, int> tMap1, tMap2;
+    for (int i=0; i<10; i++) {
+        tMap1[i] = Add(i, i);
+        tMap2[i] = i*2;
+    }
+    EXPECT_CONTAINER_EQ(tMap1, tMap2);
+
+    std::vector<bool> tBits1(100, false), tBits2(100, false);
+    tBits1[37] = tBits2[37] = true;
+    EXPECT_CONTAINER_EQ(tBits1, tBits2);
+}
+
+/* 0.1 has no exact binary form, sums differ in the last bits */
+TEST(FloatTest, Near_and_ulp)
+{
+    double dSum = 0;
+    float  fSum = 0;
+    for (int i=0; i<10; i++) {
+        dSum += 0.1;
+        fSum += 0.1f;
+    }
+    EXPECT_NE(1.0, dSum);
+    EXPECT_NEAR(1.0, dSum, 1e-9);
+    EXPECT_DOUBLE_EQ(1.0, dSum);
+    EXPECT_FLOAT_EQ(1.0f, fSum);
+
+    double adSum[16], adExpect[16];
+    for (int i=0; i<16; i++) {
+        adSum[i] = i*0.1 + i*0.2;
+        adExpect[i] = i*0.3;
+    }
+    EXPECT_ARRAY_NEAR(adSum, adExpect, 16, 1e-9);
+    EXPECT_ARRAY_REL_NEAR(adSum, adExpect, 16, 1e-12);
+    EXPECT_ARRAY_ULP_NEAR(adSum, adExpect, 16, 4);
+}
+
+/* Run with --gtest_filter=*-*_fail:*Stress to skip the failing and the long
+   cases, patterns after '-' are negative */
+TEST(FilterTest, Negative_patterns)
+{
+    EXPECT_TRUE(SpFilterMatch("*-*_fail:*Stress", "NormalTest", "test_good"));
+    EXPECT_FALSE(SpFilterMatch("*-*_fail:*Stress", "NormalTest", "NormalTest_all_fail"));
+    EXPECT_FALSE(SpFilterMatch("*-*_fail:*Stress", "Default", "Mocker_Thread_Stress"));
+    EXPECT_TRUE(SpFilterMatch("-*_fail", "SuiteTest", "Test_add_function"));
+    EXPECT_FALSE(SpFilterMatch("Normal*:Assert*-*_fail", "SuiteTest", "Test_add_function"));
+    EXPECT_TRUE(SpFilterMatch("Normal*:Assert*-*_fail", "NormalTest", "test_add_function"));
+    EXPECT_FALSE(SpFilterMatch("Normal*:Assert*-*_fail", "AssertTest", "AssertTest_fail"));
+}
+
 class MyEnvironment : public testing::Environment
 {
     void SetUp()
@@ -100,12 +172,63 @@ class MyEnvironment : public testing::Environment
     }
 };
 
+/* With --trace_output=FILE the trace is read back when the run is finished:
+   braces must balance and every event name must be plain text */
+static int CheckTraceFile(int argc, char* argv[])
+{
+    const char *pFile = NULL;
+    for (int i=1; i<argc; i++)
+        if (!strncmp(argv[i], "--trace_output=", 15))
+            pFile = argv[i]+15;
+    if (!pFile)
+        return 0;
+
+    FILE *fp = fopen(pFile, "rb");
+    if (!fp) {
+        printf("Trace file %s is not written.\n", pFile);
+        return 1;
+    }
+    std::string tTrace;
+    char abBuf[4096];
+    size_t len;
+    while ((len = fread(abBuf, 1, sizeof(abBuf), fp)) > 0)
+        tTrace.append(abBuf, len);
+    fclose(fp);
+
+    int depth = 0, events = 0;
+    bool blInStr = false;
+    for (size_t i=0; i<tTrace.size(); i++) {
+        char c = tTrace[i];
+        if (c == '"')
+            blInStr = !blInStr;
+        else if (!blInStr && (c == '{' || c == '['))
+            depth++;
+        else if (!blInStr && (c == '}' || c == ']'))
+            depth--;
+    }
+    for (size_t pos=0; (pos = tTrace.find("\"name\":\"", pos)) != std::string::npos; events++) {
+        pos += 8;
+        size_t end = tTrace.find('"', pos);
+        if (end == std::string::npos || tTrace.find_first_not_of(
+                "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_. ", pos) < end) {
+            printf("Trace file %s has a bad event name at offset %d.\n", pFile, (int)pos);
+            return 1;
+        }
+    }
+    if (depth || blInStr || !events) {
+        printf("Trace file %s is not complete.\n", pFile);
+        return 1;
+    }
+    printf("Trace file %s checked, %d events.\n", pFile, events);
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
     SpUnitInit(argc, argv);
     testing::AddGlobalTestEnvironment(new MyEnvironment);
     SpUnitRunAll();
-    return 0;
+    return CheckTraceFile(argc, argv);
 }
 
 TEST_S(Mocker_Simple)
@@ -146,6 +269,36 @@ TEST_S(Mocker)
     printf("------------------------- Mocker test End \n");
 }
 
+int Inc(int a)
+{
+    return a+1;
+}
+
+TEST_S(Mocker_Return_range)
+{
+    SPMOCKER(Inc).retRange(1, 3).retRange(10, 0, -5).retTimes(7, 2).retRange(100, 106, 3);
+    EXPECT_EQ(1, Inc(1));
+    EXPECT_EQ(2, Inc(1));
+    EXPECT_EQ(3, Inc(1));
+    EXPECT_EQ(10, Inc(1));
+    EXPECT_EQ(5, Inc(1));
+    EXPECT_EQ(0, Inc(1));
+    EXPECT_EQ(7, Inc(1));
+    EXPECT_EQ(7, Inc(1));
+    EXPECT_EQ(100, Inc(1));
+    EXPECT_EQ(103, Inc(1));
+    EXPECT_EQ(106, Inc(1));
+    EXPECT_EQ(2, Inc(1));
+
+    /* a million values are kept as one run */
+    SPMOCKER(Inc).retRange(0, 999999);
+    long long sum = 0;
+    for (int i=0; i<1000000; i++)
+        sum += Inc(1);
+    EXPECT_EQ(999999LL*1000000/2, sum);
+    EXPECT_EQ(2, Inc(1));
+}
+
 TEST_S(Mocker_next_case_make_sure_last_mock_reseted)
 {
     SPMOCKER(Sub).retAlways(100);
@@ -181,3 +334,53 @@ TEST_S(Mocker_Replace_arg_value)
     EXPECT_EQ(a, 100);
     EXPECT_EQ(b, 200);
 }
+
+int Square(int a)
+{
+    return a*a;
+}
+
+struct MockStress {
+    int         calls;
+    long long   sum;
+};
+
+static void MockStressWorker(void *arg)
+{
+    MockStress *p = (MockStress *)arg;
+    long long sum = 0;
+    for (int i=0; i<p->calls; i++)
+        sum += Square(3);
+    __sync_fetch_and_add(&p->sum, sum);
+}
+
+/* Mocked calls from many threads, each return value is taken once and the
+   last caller unhooks */
+TEST_S(Mocker_Thread_Stress)
+{
+    for (int threads=1; threads<=8; threads*=2) {
+        MockStress tStress = { 200000, 0 };
+        SPMOCKER(Square).retTimes(1, threads*tStress.calls);
+
+        long long tStart = SpGetWallTime();
+        SpRunThreads(threads, MockStressWorker, &tStress);
+        long long cost = SpGetWallTime() - tStart;
+
+        printf("%d threads, %.1f M mocked calls/s\n", threads, threads*tStress.calls*1e3/cost);
+        EXPECT_EQ(threads*tStress.calls, tStress.sum);
+        EXPECT_EQ(9, Square(3));
+    }
+}
+
+BENCHMARK(BenchTest, Add_function)
+{
+    DoNotOptimize(Add(1,1));
+}
+
+BENCHMARK(BenchTest, Assertion_pass)
+{
+    int a = 2;
+    DoNotOptimize(a);
+    EXPECT_EQ(2, a);
+    EXPECT_STREQ(pGlbStr, "Hanxiangguo");
+}
@@ -3,8 +3,10 @@
 #define _SpUnit_h
 
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
+#include <vector>
 
 /**
     SparrowUnit is fully compatible with gtest.
@@ -19,10 +21,70 @@ namespace SparrowUnit {
     Define class
  ***********************************************************************/
 class SpUnit;
+
+typedef enum {
+    SpPhase_SetUp=0,
+    SpPhase_TestBody,
+    SpPhase_TearDown,
+    SpPhase_Count,
+}SpPhase;
+
+struct SpTiming {
+    long long   wallTime[SpPhase_Count];    /* ns, monotonic clock */
+    long long   cpuTime[SpPhase_Count];     /* ns, cpu time of running thread */
+
+    long long   totalWall() const { return wallTime[SpPhase_SetUp]+wallTime[SpPhase_TestBody]+wallTime[SpPhase_TearDown]; }
+    long long   totalCpu() const { return cpuTime[SpPhase_SetUp]+cpuTime[SpPhase_TestBody]+cpuTime[SpPhase_TearDown]; }
+};
+
+/* Per iteration statistic of a benchmark case, in ns */
+struct SpBenchStat {
+    long long   iterations;     /* measured iterations, 0 for a normal case */
+    double      min;
+    double      median;
+    double      mean;
+    double      p99;
+    double      stddev;
+};
+
+typedef enum {
+    SpCounter_Cycles=0,
+    SpCounter_Instructions,
+    SpCounter_BranchMisses,
+    SpCounter_L1DMisses,
+    SpCounter_LLCMisses,
+    SpCounter_Count,
+}SpCounter;
+
+/* Hardware counters of TestBody, -1 if the counter is not available */
+struct SpPerfStat {
+    long long   value[SpCounter_Count];
+};
+
+/* Heap usage of a case on the thread that runs it, needs SP_ALLOC_TRACK */
+struct SpAllocStat {
+    long long   count;      /* blocks allocated */
+    long long   bytes;      /* bytes allocated */
+    long long   peak;       /* peak of bytes in use */
+    long long   leaked;     /* blocks allocated by the case and not freed */
+};
+
+/* Static descriptor of a case, constant initialized and linked into the case
+   list at registration without allocation. The case object is created by
+   pCreate right before it runs and deleted right after. */
+struct SpCaseInfo {
+    const char  *pSuite;
+    const char  *pName;
+    const char  *pFile;
+    int         line;
+    SpUnit      *(*pCreate)();
+    SpCaseInfo  *pNext;
+};
+
 class SpCaseDB {
 public:
-    static int  Register(SpUnit* p);
-    static void writeData(const std::string &tFileName);
+    static int  Register(SpCaseInfo *p);
+    static SpCaseInfo *first();
 };
 
 class SpEnv {
@@ -34,19 +96,31 @@ public:
 
 class SpUnit : public SpEnv {
 public:
+    struct FailSite {
+        const char  *pFile;
+        int         line;
+        int         hits;
+    };
+
     SpUnit();
 
     const std::string  &getSuiteName() const { return tTestSuiteName; }
     const std::string  &getTestName() const { return tTestCaseName; }
     const std::string  &getTestFile() const { return tTestCaseFile; }
     const std::string  &getFailInfo() const { return tFailInfo; }
+    const std::string  &getOutput() const { return tOutput; }
 
     int     getFailCount() const { return FailTestCount; }
     int     getSuccessCount() const { return SuccessTestCount; }
-
-    bool    isMatch(const std::string &filter);
-
-    void    addFailInfo(const std::string &tErr) { tFailInfo += tErr; }
+    long long       getRunTime() const { return tTiming.totalWall(); }
+    const SpTiming  &getTiming() const { return tTiming; }
+    const SpBenchStat &getBenchStat() const { return tBenchStat; }
+    const SpPerfStat  &getPerfStat() const { return tPerfStat; }
+    const SpAllocStat &getAllocStat() const { return tAllocStat; }
+    const std::vector<FailSite> &getFailSites() const { return tFailSites; }
+
+    bool    addFailSite(const char *pFile, int line);
+    bool    addFailInfo(const std::string &tErr);
     void    addResult(bool blRet);
     void    showResult() const ;
     int     runTest();
@@ -57,12 +131,33 @@ protected:
     std::string tTestCaseFile;
 
     virtual void TestBody() = 0;
+    void    setBenchStat(const SpBenchStat &t) { tBenchStat = t; }
 
 private:
     void    reset();
+    void    showFailSites();
     int     SuccessTestCount;
     int     FailTestCount;
+    SpTiming    tTiming;
+    SpBenchStat tBenchStat;
+    SpPerfStat  tPerfStat;
+    SpAllocStat tAllocStat;
     std::string tFailInfo;
+    std::string tOutput;        /* stdout and stderr of the case, --capture-output */
+    std::vector<FailSite>   tFailSites;
+    size_t      lastSite;       /* a failing loop hits the same site again */
+    int         printCount;     /* failure messages printed to console */
+    bool        blInfoFull;
+};
+
+/* Benchmark case, BenchBody is run in batches until the measure time is used up */
+class SpBench : public SpUnit {
+protected:
+    virtual void BenchBody() = 0;
+
+private:
+    void        TestBody();
+    long long   runBatch(long long iterations);
 };
 
 /*******************************************************************//**
@@ -84,33 +179,53 @@ typedef enum {
 
 void SpSetConsoleColor(ColorType t);
 void SpUnitPrintf(ColorType Color, const char *pFormat, ...);
-extern SpUnit *currentUnitCase;
+extern __thread SpUnit *currentUnitCase;     /* case running on this thread */
 
 #define _SpErrorLog(...)         SpUnitPrintf(ColorType_Red, __VA_ARGS__)
 #define _SpWarnLog(...)          SpUnitPrintf(ColorType_Yellow, __VA_ARGS__)
 #define _SpRunLog(...)           SpUnitPrintf(ColorType_Green, __VA_ARGS__)
 
+/* Message streamed after an assertion, EXPECT_EQ(a, b) << "info", costs nothing */
+class SpMessage {
+public:
+    template <typename T>
+    SpMessage &operator<<(const T &) { return *this; }
+    SpMessage &operator<<(std::ostream &(*)(std::ostream &)) { return *this; }
+};
+
+/* Allocations made while one lives are the framework's own, failure messages,
+   console and trace buffers, mock scripts, and are not charged to the case */
+class SpAllocPause {
+public:
+    SpAllocPause();
+    ~SpAllocPause();
+};
+
+/* Expression and file name are string literals from the macros, no std::string
+   is built until an assertion fails. */
 namespace Compare {
+    bool   KeepFailure(const char *file, int line);
+    void   ReportFailure(const std::string &tInfo);
+
     template <typename T, typename U>
-    void Show2Arg(const T &t1, const U &t2, const std::string &expr1, const std::string &expr2, const std::string &content, const std::string &file, int line) {
-        SpSetConsoleColor(ColorType_Red);
+    void Show2Arg(const T &t1, const U &t2, const char *expr1, const char *expr2, const char *content, const char *file, int line) {
+        SpAllocPause tPause;
+        if (!KeepFailure(file, line))
+            return;
+
         std::stringstream tStrStream;
-        tStrStream << file << ":" << line << "Failure" << std::endl;
+        tStrStream << file << ":" << line << " Failure" << std::endl;
         tStrStream << "Expression expect [ " << expr1 << " ] "<< content << " [ " << expr2 << " ] " << std::endl;
         tStrStream << "Expr left  = [" << t1 << "]" << std::endl;
         tStrStream << "Expr right = [" << t2 << "]" << std::endl;
-
-        if (currentUnitCase)
-            currentUnitCase->addFailInfo(tStrStream.str());
-        std::cout << tStrStream.str();
-        SpSetConsoleColor(ColorType_White);
+        ReportFailure(tStrStream.str());
     }
     std::string ToLower(std::string str);
 
 #define _SpGenCompareCode(FuncName, Expr, Description)\
             template <typename T, typename U>\
-            bool FuncName(const T &t1, const U &t2, const std::string &expr1, const std::string &expr2, \
-                          const std::string &file, int line) {\
+            bool FuncName(const T &t1, const U &t2, const char *expr1, const char *expr2, \
+                          const char *file, int line) {\
                 if(Expr)  return true;\
                 Show2Arg(t1, t2, expr1, expr2, Description, file, line);\
                 return false;\
@@ -121,6 +236,38 @@ namespace Compare {
     _SpGenCompareCode(CheckGreatEqualThan, t1>=t2, "great or equal than");
     _SpGenCompareCode(CheckLessThan, t1<t2, "less than");
     _SpGenCompareCode(CheckLessEqualThan, t1<=t2, "less or equal than");
+
+    /* C string compare, NULL only equals NULL */
+    inline const char *CStr(const char *p) { return p; }
+    inline const char *CStr(const std::string &t) { return t.c_str(); }
+    int  StrCmp(const char *p1, const char *p2, bool blIgnoreCase);
+    void ShowStr(const char *p1, const char *p2, const char *expr1, const char *expr2, const char *content, const char *file, int line);
+
+#define _SpGenStrCompareCode(FuncName, Expr, IgnoreCase, Description)\
+            template <typename T, typename U>\
+            bool FuncName(const T &t1, const U &t2, const char *expr1, const char *expr2, \
+                          const char *file, int line) {\
+                int ret = StrCmp(CStr(t1), CStr(t2), IgnoreCase);\
+                if(Expr)  return true;\
+                ShowStr(CStr(t1), CStr(t2), expr1, expr2, Description, file, line);\
+                return false;\
+            }
+    _SpGenStrCompareCode(CheckStrEqu, ret==0, false, "equal to");
+    _SpGenStrCompareCode(CheckStrNotEqu, ret!=0, false, "not equal to");
+    _SpGenStrCompareCode(CheckStrCaseEqu, ret==0, true, "equal (ignoring case) to");
+    _SpGenStrCompareCode(CheckStrCaseNotEqu, ret!=0, true, "not equal (ignoring case) to");
+}
+
+/*******************************************************************//**
+    Benchmark helper, keep compiler from optimizing the measured code away
+ ***********************************************************************/
+template <typename T>
+inline void DoNotOptimize(T const &value) {
+    __asm__ __volatile__("" : : "r,m"(value) : "memory");
+}
+
+inline void ClobberMemory() {
+    __asm__ __volatile__("" : : : "memory");
 }
 
 /*******************************************************************//**
@@ -128,27 +275,77 @@ namespace Compare {
  ***********************************************************************/
 #define _SpGetTestCName(test_suite_name, test_name)  CUT##test_suite_name##test_name
 #define TEST_FORMAT(test_suite_name, test_name, BaseClass) \
+                _SpCaseFormat(test_suite_name, test_name, BaseClass, TestBody)
+#define _SpCaseFormat(test_suite_name, test_name, BaseClass, BodyName) \
                 class _SpGetTestCName(test_suite_name, test_name) : public BaseClass {\
                 public:\
-                    void TestBody(); \
+                    void BodyName(); \
                     _SpGetTestCName(test_suite_name, test_name)() {\
                         tTestSuiteName = #test_suite_name; \
                         tTestCaseName = #test_name; \
                         tTestCaseFile = __FILE__; \
                     } \
+                    static SpUnit *create() { return new _SpGetTestCName(test_suite_name, test_name)(); } \
+                    static SpCaseInfo myInfo; \
                     static int myTempData; \
                 }; \
+                SpCaseInfo _SpGetTestCName(test_suite_name, test_name)::myInfo = { #test_suite_name, #test_name, \
+                            __FILE__, __LINE__, _SpGetTestCName(test_suite_name, test_name)::create, NULL }; \
                 int _SpGetTestCName(test_suite_name, test_name)::myTempData = \
-                            SpCaseDB::Register(new _SpGetTestCName(test_suite_name, test_name)());\
-                void _SpGetTestCName(test_suite_name, test_name)::TestBody()
+                            SpCaseDB::Register(&_SpGetTestCName(test_suite_name, test_name)::myInfo);\
+                void _SpGetTestCName(test_suite_name, test_name)::BodyName()
+
+/* Every assertion has a static descriptor, constant initialized so it costs
+   nothing until it runs. On ELF the address of it is put in section
+   sp_assert_sites by the assembler, so sites that never run are known as
+   well. On Windows a site is listed when it runs first; -fPIC code may be
+   in a shared library, whose section is not seen, so it is listed too. */
+struct SpAssertSite {
+    const char  *pFile;
+    int         line;
+    const char  *pCheck;        /* comparator */
+    const char  *pExpr1;
+    const char  *pExpr2;
+    long long   passCount;
+    long long   failCount;
+    bool        blListed;
+};
+
+void SpListSite(SpAssertSite &tSite);
+inline void SpSiteResult(SpAssertSite &tSite, bool blRet) {
+    __sync_fetch_and_add(blRet ? &tSite.passCount : &tSite.failCount, 1);
+}
+
+#if defined(__MINGW32__)
+#define _SpSiteDefine(check, expr1, expr2) \
+                static SpAssertSite _spSite = { __FILE__, __LINE__, check, expr1, expr2, 0, 0, false }; \
+                if (!_spSite.blListed) SpListSite(_spSite)
+#else
+#if defined(__PIC__) && !defined(__PIE__)
+#define _SpSiteListRun(site)    if (!site.blListed) SpListSite(site)
+#define _SpSiteListed           false
+#else
+#define _SpSiteListRun(site)
+#define _SpSiteListed           true
+#endif
+/* "X" and %p: the symbol of the site, also where -fPIC allows no immediate */
+#define _SpSiteDefine(check, expr1, expr2) \
+                static SpAssertSite _spSite = { __FILE__, __LINE__, check, expr1, expr2, 0, 0, _SpSiteListed }; \
+                __asm__ __volatile__(".pushsection sp_assert_sites,\"aw\"\n\t.balign %c1\n\t.dc.a %p0\n\t.popsection" \
+                                     :: "X"(&_spSite), "i"(sizeof(void *))); \
+                _SpSiteListRun(_spSite)
+#endif
 
 #define EXPECT_FORMAT(a, b, cond, errorret)     do { \
+                _SpSiteDefine(#cond, #a, #b); \
                 if (!cond(a, b, #a, #b, __FILE__, __LINE__)) { \
+                    SpSiteResult(_spSite, false); \
                     if (currentUnitCase) currentUnitCase->addResult(false); \
                     if (errorret) throw 1; \
                 } else { \
+                    SpSiteResult(_spSite, true); \
                     if (currentUnitCase) currentUnitCase->addResult(true); \
-                }}while(0); std::ostringstream()
+                }}while(0); SpMessage()
 
 /*******************************************************************//**
     Define test case
@@ -156,6 +353,7 @@ namespace Compare {
 #define TEST(test_case_name, test_name) TEST_FORMAT(test_case_name, test_name, SpUnit)
 #define TEST_S(test_case_name)          TEST_FORMAT(Default, test_case_name, SpUnit)
 #define TEST_F(test_class, test_name)   TEST_FORMAT(test_class, test_name, test_class)
+#define BENCHMARK(test_case_name, test_name)    _SpCaseFormat(test_case_name, test_name, SpBench, BenchBody)
 
 /*******************************************************************//**
   Compare instructions
@@ -168,10 +366,10 @@ namespace Compare {
 #define EXPECT_GE(a, b)         	EXPECT_FORMAT(a, b, Compare::CheckGreatEqualThan, false)
 #define EXPECT_LT(a, b)         	EXPECT_FORMAT(a, b, Compare::CheckLessThan, false)
 #define EXPECT_LE(a, b)         	EXPECT_FORMAT(a, b, Compare::CheckLessEqualThan, false)
-#define EXPECT_STREQ(a, b)      	EXPECT_EQ(std::string(a), std::string(b))
-#define EXPECT_STRNE(a, b)      	EXPECT_NE(std::string(a), std::string(b))
-#define EXPECT_STRCASEEQ(a, b)      EXPECT_EQ(Compare::ToLower(std::string(a)), Compare::ToLower(std::string(b)))
-#define EXPECT_STRCASENE(a, b)      EXPECT_NE(Compare::ToLower(std::string(a)), Compare::ToLower(std::string(b)))
+#define EXPECT_STREQ(a, b)      	EXPECT_FORMAT(a, b, Compare::CheckStrEqu, false)
+#define EXPECT_STRNE(a, b)      	EXPECT_FORMAT(a, b, Compare::CheckStrNotEqu, false)
+#define EXPECT_STRCASEEQ(a, b)      EXPECT_FORMAT(a, b, Compare::CheckStrCaseEqu, false)
+#define EXPECT_STRCASENE(a, b)      EXPECT_FORMAT(a, b, Compare::CheckStrCaseNotEqu, false)
 
 #define ASSERT_TRUE(a, b)         	EXPECT_FORMAT(a, false, Compare::CheckNotEqu, true)
 #define ASSERT_FALSE(a, b)         	EXPECT_FORMAT(a, false, Compare::CheckEqu, true)
@@ -181,10 +379,318 @@ namespace Compare {
 #define ASSERT_GE(a, b)         	EXPECT_FORMAT(a, b, Compare::CheckGreatEqualThan, true)
 #define ASSERT_LT(a, b)         	EXPECT_FORMAT(a, b, Compare::CheckLessThan, true)
 #define ASSERT_LE(a, b)         	EXPECT_FORMAT(a, b, Compare::CheckLessEqualThan, true)
-#define ASSERT_STREQ(a, b)      	ASSERT_EQ(std::string(a), std::string(b))
-#define ASSERT_STRNE(a, b)      	ASSERT_NE(std::string(a), std::string(b))
-#define ASSERT_STRCASEEQ(a, b)      ASSERT_EQ(Compare::ToLower(std::string(a)), Compare::ToLower(std::string(b)))
-#define ASSERT_STRCASENE(a, b)      ASSERT_NE(Compare::ToLower(std::string(a)), Compare::ToLower(std::string(b)))
+#define ASSERT_STREQ(a, b)      	EXPECT_FORMAT(a, b, Compare::CheckStrEqu, true)
+#define ASSERT_STRNE(a, b)      	EXPECT_FORMAT(a, b, Compare::CheckStrNotEqu, true)
+#define ASSERT_STRCASEEQ(a, b)      EXPECT_FORMAT(a, b, Compare::CheckStrCaseEqu, true)
+#define ASSERT_STRCASENE(a, b)      EXPECT_FORMAT(a, b, Compare::CheckStrCaseNotEqu, true)
+
+/*******************************************************************//**
+  Bulk compare instructions, a whole buffer counts as one assertion and only
+  a window around the first mismatch is shown on failure.
+ ***********************************************************************/
+namespace Compare {
+    const size_t BulkWindow = 8;    /* elements shown on each side of a mismatch */
+
+    size_t MemDiff(const void *p1, const void *p2, size_t len);
+    bool   CheckMemEqu(const void *p1, const void *p2, size_t len, const char *expr1,
+                       const char *expr2, const char *file, int line);
+
+    /* first index where the two arrays differ, n if none; plain integers go to MemDiff */
+    template <typename T, typename U>
+    size_t ArrayDiff(const T *p1, const U *p2, size_t n) {
+        size_t i = 0;
+        while (i<n && p1[i]==p2[i])
+            i++;
+        return i;
+    }
+#define _SpGenArrayDiffCode(Type)\
+    inline size_t ArrayDiff(const Type *p1, const Type *p2, size_t n) {\
+        return MemDiff(p1, p2, n*sizeof(Type))/sizeof(Type);\
+    }
+    _SpGenArrayDiffCode(char);
+    _SpGenArrayDiffCode(signed char);
+    _SpGenArrayDiffCode(unsigned char);
+    _SpGenArrayDiffCode(short);
+    _SpGenArrayDiffCode(unsigned short);
+    _SpGenArrayDiffCode(int);
+    _SpGenArrayDiffCode(unsigned int);
+    _SpGenArrayDiffCode(long);
+    _SpGenArrayDiffCode(unsigned long);
+    _SpGenArrayDiffCode(long long);
+    _SpGenArrayDiffCode(unsigned long long);
+
+    /* IsStreamable<T>::value tells whether "os << t" compiles, the fallback below only wins without a real one */
+    namespace StreamProbe {
+        struct NoStream { char a[2]; };
+        struct AnyType { template <typename T> AnyType(const T &) {} };
+        NoStream operator<<(std::ostream &os, const AnyType &t);
+        char     Probe(std::ostream &os);
+        NoStream Probe(NoStream t);
+
+        template <typename T>
+        struct IsStreamable {
+            static std::ostream &os;
+            static const T &t;
+            enum { value = sizeof(Probe(os << t)) == sizeof(char) };
+        };
+    }
+    using StreamProbe::IsStreamable;
+
+    template <typename T>
+    void PrintElem(std::ostream &os, const T &t) { os << t; }
+    inline void PrintElem(std::ostream &os, char t) { os << (int)t; }
+    inline void PrintElem(std::ostream &os, signed char t) { os << (int)t; }
+    inline void PrintElem(std::ostream &os, unsigned char t) { os << (int)t; }
+
+    /* window around pos, iterator may be a plain pointer; elements that cannot be streamed are not shown */
+    template <bool blPrint>
+    struct ElemWindow {
+        template <typename It>
+        static void Show(std::ostream &, const char *, It, size_t, size_t) {}
+    };
+    template <>
+    struct ElemWindow<true> {
+        template <typename It>
+        static void Show(std::ostream &os, const char *pName, It it, size_t n, size_t pos) {
+            size_t start = pos>BulkWindow ? pos-BulkWindow : 0;
+            size_t end = n-pos>BulkWindow ? pos+BulkWindow+1 : n;
+
+            std::advance(it, start);
+            os << pName << "[" << start << ".." << end-1 << "] = [";
+            for (size_t i=start; i<end; i++, ++it) {
+                os << (i==start ? "" : ", ") << (i==pos ? "*" : "");
+                PrintElem(os, *it);
+            }
+            os << (end<n ? ", ...]" : "]") << std::endl;
+        }
+    };
+
+    template <typename T, typename U>
+    bool ShowArray(const T *p1, size_t n1, const U *p2, size_t n2, size_t pos, const char *expr1,
+                   const char *expr2, const char *file, int line) {
+        SpAllocPause tPause;
+        if (!KeepFailure(file, line))
+            return false;
+
+        std::stringstream tStrStream;
+        tStrStream << file << ":" << line << " Failure" << std::endl;
+        tStrStream << "Expression expect [ " << expr1 << " ] equal to [ " << expr2 << " ]" << std::endl;
+        if (n1 != n2)
+            tStrStream << "Size       = [" << n1 << "] vs [" << n2 << "]" << std::endl;
+        if (pos < n1 && pos < n2) {
+            tStrStream << "First mismatch at index " << pos << std::endl;
+            ElemWindow<IsStreamable<T>::value && IsStreamable<U>::value>::Show(tStrStream, "Left  ", p1, n1, pos);
+            ElemWindow<IsStreamable<T>::value && IsStreamable<U>::value>::Show(tStrStream, "Right ", p2, n2, pos);
+        }
+        ReportFailure(tStrStream.str());
+        return false;
+    }
+
+    template <typename T, typename U>
+    bool CheckArrayEqu(const T *p1, const U *p2, size_t n, const char *expr1,
+                       const char *expr2, const char *file, int line) {
+        size_t pos = ArrayDiff(p1, p2, n);
+        if (pos == n)
+            return true;
+        return ShowArray(p1, n, p2, n, pos, expr1, expr2, file, line);
+    }
+
+    /* elements are printed only when they can be streamed, a std::map only gets the index */
+    template <typename T, typename U>
+    bool ShowContainer(const T &t1, const U &t2, size_t pos, const char *expr1,
+                       const char *expr2, const char *file, int line) {
+        SpAllocPause tPause;
+        if (!KeepFailure(file, line))
+            return false;
+
+        const bool blPrint = IsStreamable<typename T::value_type>::value && IsStreamable<typename U::value_type>::value;
+        std::stringstream tStrStream;
+        tStrStream << file << ":" << line << " Failure" << std::endl;
+        tStrStream << "Expression expect [ " << expr1 << " ] equal to [ " << expr2 << " ]" << std::endl;
+        if (t1.size() != t2.size())
+            tStrStream << "Size       = [" << t1.size() << "] vs [" << t2.size() << "]" << std::endl;
+        if (pos < t1.size() && pos < t2.size()) {
+            tStrStream << "First mismatch at index " << pos << std::endl;
+            ElemWindow<blPrint>::Show(tStrStream, "Left  ", t1.begin(), t1.size(), pos);
+            ElemWindow<blPrint>::Show(tStrStream, "Right ", t2.begin(), t2.size(), pos);
+        }
+        ReportFailure(tStrStream.str());
+        return false;
+    }
+
+    /* walks both sides with iterators, no copy and no contiguous storage needed */
+    template <typename T, typename U>
+    bool CheckRangeEqu(const T &t1, const U &t2, const char *expr1,
+                       const char *expr2, const char *file, int line) {
+        typename T::const_iterator it1 = t1.begin();
+        typename U::const_iterator it2 = t2.begin();
+        size_t pos = 0;
+        while (it1!=t1.end() && it2!=t2.end() && *it1==*it2) {
+            ++it1;
+            ++it2;
+            pos++;
+        }
+        if (it1 == t1.end() && it2 == t2.end())
+            return true;
+        return ShowContainer(t1, t2, pos, expr1, expr2, file, line);
+    }
+
+    template <typename T, typename A>
+    const T *VecData(const std::vector<T, A> &v) { return v.empty() ? NULL : &v[0]; }
+
+    /* contiguous storage, goes through the block compare */
+    template <typename T, typename A, typename U, typename B>
+    bool CheckContainerEqu(const std::vector<T, A> &t1, const std::vector<U, B> &t2, const char *expr1,
+                           const char *expr2, const char *file, int line) {
+        size_t n = t1.size()<t2.size() ? t1.size() : t2.size();
+        size_t pos = n ? ArrayDiff(&t1[0], &t2[0], n) : 0;
+        if (pos == n && t1.size() == t2.size())
+            return true;
+        return ShowArray(VecData(t1), t1.size(), VecData(t2), t2.size(), pos, expr1, expr2, file, line);
+    }
+
+    /* std::vector<bool> packs bits and has no element address */
+    template <typename A, typename B>
+    bool CheckContainerEqu(const std::vector<bool, A> &t1, const std::vector<bool, B> &t2, const char *expr1,
+                           const char *expr2, const char *file, int line) {
+        return CheckRangeEqu(t1, t2, expr1, expr2, file, line);
+    }
+
+    /* any container with size(), begin() and end() */
+    template <typename T, typename U>
+    bool CheckContainerEqu(const T &t1, const U &t2, const char *expr1,
+                           const char *expr2, const char *file, int line) {
+        return CheckRangeEqu(t1, t2, expr1, expr2, file, line);
+    }
+}
+
+typedef enum {
+    SpNear_Abs=0,       /* |a-b| <= tolerance */
+    SpNear_Rel,         /* |a-b| <= tolerance*max(|a|,|b|) */
+    SpNear_Ulp,         /* a and b are at most tolerance representable values apart */
+}SpNearMode;
+
+/* Floating point compare, FLOAT_EQ and DOUBLE_EQ allow 4 ULP like gtest */
+namespace Compare {
+    const int MaxUlps = 4;
+
+    bool CheckNear(double v1, double v2, double absError, const char *expr1, const char *expr2,
+                   const char *exprError, const char *file, int line);
+    bool CheckFloatEqu(float v1, float v2, const char *expr1, const char *expr2, const char *file, int line);
+    bool CheckDoubleEqu(double v1, double v2, const char *expr1, const char *expr2, const char *file, int line);
+    bool CheckArrayNear(const float *p1, const float *p2, size_t n, double tolerance, SpNearMode mode,
+                        const char *expr1, const char *expr2, const char *file, int line);
+    bool CheckArrayNear(const double *p1, const double *p2, size_t n, double tolerance, SpNearMode mode,
+                        const char *expr1, const char *expr2, const char *file, int line);
+}
+
+#define _SpBulkFormat(func, args, expr1, expr2, errorret)   do { \
+                _SpSiteDefine(#func, expr1, expr2); \
+                bool _spRet = func args; \
+                SpSiteResult(_spSite, _spRet); \
+                if (currentUnitCase) currentUnitCase->addResult(_spRet); \
+                if (!_spRet && errorret) throw 1; \
+                }while(0); SpMessage()
+
+#define EXPECT_MEMEQ(a, b, len)     _SpBulkFormat(Compare::CheckMemEqu, (a, b, len, #a, #b, __FILE__, __LINE__), #a, #b, false)
+#define EXPECT_ARRAY_EQ(a, b, n)    _SpBulkFormat(Compare::CheckArrayEqu, (a, b, n, #a, #b, __FILE__, __LINE__), #a, #b, false)
+#define EXPECT_CONTAINER_EQ(a, b)   _SpBulkFormat(Compare::CheckContainerEqu, (a, b, #a, #b, __FILE__, __LINE__), #a, #b, false)
+#define ASSERT_MEMEQ(a, b, len)     _SpBulkFormat(Compare::CheckMemEqu, (a, b, len, #a, #b, __FILE__, __LINE__), #a, #b, true)
+#define ASSERT_ARRAY_EQ(a, b, n)    _SpBulkFormat(Compare::CheckArrayEqu, (a, b, n, #a, #b, __FILE__, __LINE__), #a, #b, true)
+#define ASSERT_CONTAINER_EQ(a, b)   _SpBulkFormat(Compare::CheckContainerEqu, (a, b, #a, #b, __FILE__, __LINE__), #a, #b, true)
+
+#define EXPECT_NEAR(a, b, abs_error)                _SpBulkFormat(Compare::CheckNear, (a, b, abs_error, #a, #b, #abs_error, __FILE__, __LINE__), #a, #b, false)
+#define EXPECT_FLOAT_EQ(a, b)                       _SpBulkFormat(Compare::CheckFloatEqu, (a, b, #a, #b, __FILE__, __LINE__), #a, #b, false)
+#define EXPECT_DOUBLE_EQ(a, b)                      _SpBulkFormat(Compare::CheckDoubleEqu, (a, b, #a, #b, __FILE__, __LINE__), #a, #b, false)
+#define EXPECT_ARRAY_NEAR(a, b, n, abs_error)       _SpBulkFormat(Compare::CheckArrayNear, (a, b, n, abs_error, SpNear_Abs, #a, #b, __FILE__, __LINE__), #a, #b, false)
+#define EXPECT_ARRAY_REL_NEAR(a, b, n, rel_error)   _SpBulkFormat(Compare::CheckArrayNear, (a, b, n, rel_error, SpNear_Rel, #a, #b, __FILE__, __LINE__), #a, #b, false)
+#define EXPECT_ARRAY_ULP_NEAR(a, b, n, max_ulps)    _SpBulkFormat(Compare::CheckArrayNear, (a, b, n, max_ulps, SpNear_Ulp, #a, #b, __FILE__, __LINE__), #a, #b, false)
+#define ASSERT_NEAR(a, b, abs_error)                _SpBulkFormat(Compare::CheckNear, (a, b, abs_error, #a, #b, #abs_error, __FILE__, __LINE__), #a, #b, true)
+#define ASSERT_FLOAT_EQ(a, b)                       _SpBulkFormat(Compare::CheckFloatEqu, (a, b, #a, #b, __FILE__, __LINE__), #a, #b, true)
+#define ASSERT_DOUBLE_EQ(a, b)                      _SpBulkFormat(Compare::CheckDoubleEqu, (a, b, #a, #b, __FILE__, __LINE__), #a, #b, true)
+#define ASSERT_ARRAY_NEAR(a, b, n, abs_error)       _SpBulkFormat(Compare::CheckArrayNear, (a, b, n, abs_error, SpNear_Abs, #a, #b, __FILE__, __LINE__), #a, #b, true)
+#define ASSERT_ARRAY_REL_NEAR(a, b, n, rel_error)   _SpBulkFormat(Compare::CheckArrayNear, (a, b, n, rel_error, SpNear_Rel, #a, #b, __FILE__, __LINE__), #a, #b, true)
+#define ASSERT_ARRAY_ULP_NEAR(a, b, n, max_ulps)    _SpBulkFormat(Compare::CheckArrayNear, (a, b, n, max_ulps, SpNear_Ulp, #a, #b, __FILE__, __LINE__), #a, #b, true)
+
+/*******************************************************************//**
+  Performance instructions
+ ***********************************************************************/
+long long SpGetWallTime();      /* ns, monotonic clock */
+
+namespace Compare {
+    bool CheckDurationLess(long long cost, long long limit, const char *expr,
+                           const char *file, int line);
+}
+
+/* Compare a measured value with the one saved in baseline file, measure
+   again when it looks regressed, so one noisy sample does not fail a case. */
+class SpRegression {
+public:
+    SpRegression(const std::string &tKey, const char *pFile, int line);
+
+    bool    next();
+    void    add(long long measured);
+    bool    check(const char *expr);
+
+private:
+    std::string tKey;
+    const char  *pFile;
+    int         line;
+    int         tries;
+    long long   best;
+    long long   baseline;
+    bool        blHasBaseline;
+};
+
+#define _SpDurationFormat(expr, ns, errorret)   do { \
+                _SpSiteDefine("Compare::CheckDurationLess", #expr, #ns); \
+                long long _spStart = SpGetWallTime(); \
+                expr; \
+                long long _spCost = SpGetWallTime() - _spStart; \
+                bool _spRet = Compare::CheckDurationLess(_spCost, ns, #expr, __FILE__, __LINE__); \
+                SpSiteResult(_spSite, _spRet); \
+                if (currentUnitCase) currentUnitCase->addResult(_spRet); \
+                if (!_spRet && errorret) throw 1; \
+                }while(0); SpMessage()
+
+#define _SpRegressionFormat(key, measured, errorret)    do { \
+                _SpSiteDefine("SpRegression::check", #key, #measured); \
+                SpRegression _spReg(key, __FILE__, __LINE__); \
+                while (_spReg.next()) \
+                    _spReg.add(measured); \
+                bool _spRet = _spReg.check(#measured); \
+                SpSiteResult(_spSite, _spRet); \
+                if (currentUnitCase) currentUnitCase->addResult(_spRet); \
+                if (!_spRet && errorret) throw 1; \
+                }while(0); SpMessage()
+
+/* Check the allocations of the following block, run once by the for loop */
+class SpAllocScope {
+public:
+    SpAllocScope(long long maxAllocs, SpAssertSite *pSite, bool blAssert);
+    bool    once();
+
+private:
+    long long       maxAllocs;
+    long long       startCount;
+    SpAssertSite    *pSite;
+    bool            blAssert;
+    bool            blDone;
+};
+
+/* the site is defined in a statement expression, the block must follow the for */
+#define _SpAllocFormat(n, errorret)     \
+                for (SpAllocScope _spAllocScope(n, ({ _SpSiteDefine("SpAllocScope::once", "allocations", #n); &_spSite; }), \
+                                                errorret); _spAllocScope.once(); )
+
+#define EXPECT_DURATION_LT(expr, ns)            _SpDurationFormat(expr, ns, false)
+#define EXPECT_NO_REGRESSION(key, measured)     _SpRegressionFormat(key, measured, false)
+#define ASSERT_DURATION_LT(expr, ns)            _SpDurationFormat(expr, ns, true)
+#define ASSERT_NO_REGRESSION(key, measured)     _SpRegressionFormat(key, measured, true)
+#define EXPECT_NO_ALLOC                         _SpAllocFormat(0, false)
+#define EXPECT_MAX_ALLOCS(n)                    _SpAllocFormat(n, false)
+#define ASSERT_NO_ALLOC                         _SpAllocFormat(0, true)
+#define ASSERT_MAX_ALLOCS(n)                    _SpAllocFormat(n, true)
 
 
 /*******************************************************************//**
@@ -194,24 +700,49 @@ class SpMockImp;
 class SpMock {
 public:
     SpMock(void *pFunc, bool reset=false);
+    ~SpMock();
     SpMock &retAlways(int value);
     SpMock &retOnce(int value);
     SpMock &retTimes(int value, int times);
-    SpMock &retRange(int valStart, int valEnd);
+    SpMock &retRange(int valStart, int valEnd, int step=1);
     SpMock &repArg(int no, void *prep, int len);
 private:
     SpMockImp *pImp;
+    bool    blReset;
 };
 
 #define SPMOCKER(Func)            SpMock((void *)Func, false)
 #define SPMOCKER_RESET(Func)      SpMock((void *)Func, true)
 
+/* Mocks set or reset while an SpMockBatch lives are written to code when it
+   is destroyed, with one protection change per page; don't call the mocked
+   functions before that */
+class SpMockBatch {
+public:
+    SpMockBatch();
+    ~SpMockBatch();
+private:
+    SpMockBatch(const SpMockBatch &);
+    SpMockBatch &operator=(const SpMockBatch &);
+};
+
+#define SPMOCKER_BATCH            for (int _spBatchOnce = 1; _spBatchOnce; ) \
+                                    for (SpMockBatch _spMockBatch; _spBatchOnce; _spBatchOnce = 0)
+
 /*******************************************************************//**
     Sparrow Unit interface
  ***********************************************************************/
 int SpUnitInit(int argc, char* argv[]);
 int SpUnitRunAll(void);
 
+/* Run pFunc(arg) on count threads at once and wait for all of them, to
+   call code under test from many threads */
+typedef void (*SpThreadFunc)(void *arg);
+void SpRunThreads(int count, SpThreadFunc pFunc, void *arg);
+
+/* Whether a run with --gtest_filter=pFilter selects case pSuite.pName */
+bool SpFilterMatch(const char *pFilter, const char *pSuite, const char *pName);
+
 }
 
 #endif
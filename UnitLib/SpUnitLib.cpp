@@ -3,17 +3,43 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <algorithm>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
 #include <time.h>
 
 #ifdef __MINGW32__
 #include <direct.h>
+#include <io.h>
 #include <windows.h>
 #endif
 
 #ifndef __MINGW32__
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #endif
 
 #include "SpUnit.h"
@@ -36,24 +62,350 @@ bool SpOSUnHookApi(void* ApiFun);
     global variable
 ******************************************************************************/
 struct SPUDB {
-    std::vector<SpUnit*> cases;
     std::vector<testing::Environment*> env;
 };
 
 SPUDB*  spudb = NULL;
 
+/* case list, in registration order, set up before any dynamic initialization */
+static SpCaseInfo   *sgCaseHead = NULL;
+static SpCaseInfo   **sgCaseTail = &sgCaseHead;
+
+static SPUDB *SpGetDB()
+{
+    if (!spudb)
+        spudb = new SPUDB;
+    return spudb;
+}
+
+#ifdef SP_ALLOC_TRACK
+static const bool sgAllocTracked = true;
+#else
+static const bool sgAllocTracked = false;
+#endif
+
+/******************************************************************************
+    Thread support
+******************************************************************************/
+class SpMutex {
+public:
+#ifdef __MINGW32__
+    SpMutex()       { InitializeCriticalSection(&tLock); }
+    ~SpMutex()      { DeleteCriticalSection(&tLock); }
+    void lock()     { EnterCriticalSection(&tLock); }
+    void unlock()   { LeaveCriticalSection(&tLock); }
+private:
+    CRITICAL_SECTION tLock;
+#else
+    SpMutex()       { pthread_mutex_init(&tLock, NULL); }
+    ~SpMutex()      { pthread_mutex_destroy(&tLock); }
+    void lock()     { pthread_mutex_lock(&tLock); }
+    void unlock()   { pthread_mutex_unlock(&tLock); }
+private:
+    pthread_mutex_t tLock;
+#endif
+};
+
+class SpAutoLock {
+public:
+    SpAutoLock(SpMutex &m) : tMutex(m) { tMutex.lock(); }
+    ~SpAutoLock() { tMutex.unlock(); }
+private:
+    SpAutoLock(const SpAutoLock &);
+    SpAutoLock &operator=(const SpAutoLock &);
+    SpMutex &tMutex;
+};
+
+struct SpThreadParam {
+    SpThreadFunc    pFunc;
+    void*           arg;
+};
+
+#ifdef __MINGW32__
+static DWORD WINAPI SpThreadEntry(LPVOID p)
+#else
+static void *SpThreadEntry(void *p)
+#endif
+{
+    SpThreadParam *pParam = (SpThreadParam *)p;
+    pParam->pFunc(pParam->arg);
+    return 0;
+}
+
+/* Run pFunc(arg) on count threads and wait for all of them to finish,
+   the calling thread is used as one of the workers. */
+void SpRunThreads(int count, SpThreadFunc pFunc, void *arg)
+{
+    SpThreadParam tParam = { pFunc, arg };
+    int i;
+
+#ifdef __MINGW32__
+    std::vector<HANDLE> tThreads;
+    for (i=1; i<count; i++) {
+        HANDLE h = CreateThread(NULL, 0, SpThreadEntry, &tParam, 0, NULL);
+        if (h)
+            tThreads.push_back(h);
+    }
+    pFunc(arg);
+    for (i=0; i<(int)tThreads.size(); i++) {
+        WaitForSingleObject(tThreads[i], INFINITE);
+        CloseHandle(tThreads[i]);
+    }
+#else
+    std::vector<pthread_t> tThreads;
+    for (i=1; i<count; i++) {
+        pthread_t tid;
+        if (!pthread_create(&tid, NULL, SpThreadEntry, &tParam))
+            tThreads.push_back(tid);
+    }
+    pFunc(arg);
+    for (i=0; i<(int)tThreads.size(); i++)
+        pthread_join(tThreads[i], NULL);
+#endif
+}
+
+/******************************************************************************
+    Time support, all in ns
+******************************************************************************/
+long long SpGetWallTime()
+{
+#ifdef __MINGW32__
+    LARGE_INTEGER tFreq, tCount;
+    QueryPerformanceFrequency(&tFreq);
+    QueryPerformanceCounter(&tCount);
+    return (long long)((double)tCount.QuadPart * 1e9 / tFreq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000LL + ts.tv_nsec;
+#endif
+}
+
+static long long SpGetCpuTime()
+{
+#ifdef __MINGW32__
+    FILETIME tCreate, tExit, tKernel, tUser;
+    if (!GetThreadTimes(GetCurrentThread(), &tCreate, &tExit, &tKernel, &tUser))
+        return 0;
+    long long kernel = ((long long)tKernel.dwHighDateTime<<32) | tKernel.dwLowDateTime;
+    long long user = ((long long)tUser.dwHighDateTime<<32) | tUser.dwLowDateTime;
+    return (kernel+user)*100;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec*1000000000LL + ts.tv_nsec;
+#endif
+}
+
+/******************************************************************************
+    Trace, events are kept in a buffer of each thread and written as Chrome
+    trace event json when the run is finished
+******************************************************************************/
+#define _SpTraceEventsPerThread     (1<<16)
+
+/* The name is copied into the buffer, so a caller may pass the name of an
+   object that dies before the trace is saved; the category must be a literal */
+struct SpTraceEvent {
+    size_t      name;       /* offset in the names of the buffer */
+    const char  *pCat;
+    long long   ts;         /* ns */
+    long long   dur;        /* ns, -1 for instant event */
+    const void  *pArg;
+};
+
+class SpTraceBuf {
+public:
+    SpTraceBuf(int tid) : tid(tid), count(0), dropped(0) {
+        pEvents = new SpTraceEvent[_SpTraceEventsPerThread];
+    }
+    ~SpTraceBuf() { delete[] pEvents; }
+
+    /* name is prefix.name if prefix is not NULL */
+    void add(const char *pPrefix, const char *pName, const char *pCat, long long ts, long long dur, const void *pArg) {
+        if (count >= _SpTraceEventsPerThread) {
+            dropped++;
+            return;
+        }
+        SpTraceEvent &e = pEvents[count++];
+        e.name = tNames.size();
+        if (pPrefix) {
+            tNames += pPrefix;
+            tNames += '.';
+        }
+        tNames.append(pName, strlen(pName)+1);
+        e.pCat = pCat;
+        e.ts = ts;
+        e.dur = dur;
+        e.pArg = pArg;
+    }
+    void write(FILE *fp, int pid, bool &blFirst) const;
+
+    int     tid;
+    int     count;
+    int     dropped;
+
+private:
+    SpTraceEvent *pEvents;
+    std::string  tNames;        /* NUL terminated names of the events */
+};
+
+static bool                     sgTraceEnabled = false;
+static SpMutex                  sgTraceLock;
+static std::vector<SpTraceBuf*> sgTraceBufs;
+static __thread SpTraceBuf      *sgTraceBuf = NULL;
+
+static int SpGetPid()
+{
+#ifdef __MINGW32__
+    return GetCurrentProcessId();
+#else
+    return getpid();
+#endif
+}
+
+static void SpTraceAdd(const char *pPrefix, const char *pName, const char *pCat, long long ts, long long dur, const void *pArg=NULL)
+{
+    if (!sgTraceEnabled)
+        return;
+
+    SpAllocPause tPause;
+    if (!sgTraceBuf) {
+        SpAutoLock tLock(sgTraceLock);
+        sgTraceBuf = new SpTraceBuf(sgTraceBufs.size()+1);
+        sgTraceBufs.push_back(sgTraceBuf);
+    }
+    sgTraceBuf->add(pPrefix, pName, pCat, ts, dur, pArg);
+}
+
+static void SpTraceInstant(const char *pName, const char *pCat, const void *pArg)
+{
+    if (sgTraceEnabled)
+        SpTraceAdd(NULL, pName, pCat, SpGetWallTime(), -1, pArg);
+}
+
+void SpTraceBuf::write(FILE *fp, int pid, bool &blFirst) const
+{
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+            blFirst?"":",\n", pid, tid, tid);
+    blFirst = false;
+
+    for (int i=0; i<count; i++) {
+        const SpTraceEvent &e = pEvents[i];
+        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+                tNames.c_str()+e.name, e.pCat, pid, tid, e.ts/1e3);
+        if (e.dur >= 0)
+            fprintf(fp, ",\"ph\":\"X\",\"dur\":%.3f", e.dur/1e3);
+        else
+            fprintf(fp, ",\"ph\":\"i\",\"s\":\"t\"");
+        if (e.pArg)
+            fprintf(fp, ",\"args\":{\"addr\":\"%p\"}", e.pArg);
+        fprintf(fp, "}");
+    }
+}
+
+static void SpTraceWriteEvents(FILE *fp, bool &blFirst)
+{
+    SpAutoLock tLock(sgTraceLock);
+    for (size_t i=0; i<sgTraceBufs.size(); i++) {
+        sgTraceBufs[i]->write(fp, SpGetPid(), blFirst);
+        if (sgTraceBufs[i]->dropped)
+            _SpWarnLog("Trace buffer of thread %d is full, %d events dropped.\n",
+                       sgTraceBufs[i]->tid, sgTraceBufs[i]->dropped);
+    }
+}
+
+/* A fork shard writes its events to its own file, the parent merges them */
+static std::vector<std::string> sgTraceShardFiles;
+
+static std::string SpTraceShardFile(const std::string &tFileName, int shard)
+{
+    char abStr[24];
+    sprintf(abStr, ".shard%d", shard);
+    return tFileName + abStr;
+}
+
+static void SpTraceWriteShard(const std::string &tFileName)
+{
+    FILE *fp = fopen(tFileName.c_str(), "wb");
+    if (!fp)
+        return;
+    bool blFirst = true;
+    SpTraceWriteEvents(fp, blFirst);
+    fclose(fp);
+}
+
+static bool SpTraceSave(const std::string &tFileName)
+{
+    FILE *fp = fopen(tFileName.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    bool blFirst = true;
+    fputs("{\"traceEvents\":[\n", fp);
+    SpTraceWriteEvents(fp, blFirst);
+
+    for (size_t i=0; i<sgTraceShardFiles.size(); i++) {
+        FILE *fpShard = fopen(sgTraceShardFiles[i].c_str(), "rb");
+        if (!fpShard)
+            continue;
+
+        char abBuf[4096];
+        size_t len;
+        bool blHead = true;
+        while ((len = fread(abBuf, 1, sizeof(abBuf), fpShard)) > 0) {
+            if (blHead && !blFirst)
+                fputs(",\n", fp);
+            fwrite(abBuf, 1, len, fp);
+            blHead = blFirst = false;
+        }
+        fclose(fpShard);
+        remove(sgTraceShardFiles[i].c_str());
+    }
+
+    fputs("\n]}\n", fp);
+    fclose(fp);
+    return true;
+}
+
+/* Time one phase of a case, also when the phase ends by an assert */
+class SpPhaseTimer {
+public:
+    SpPhaseTimer(SpTiming &t, SpPhase phase) : tTiming(t), phase(phase) {
+        wallStart = SpGetWallTime();
+        cpuStart = SpGetCpuTime();
+    }
+    ~SpPhaseTimer() {
+        static const char *pPhaseName[SpPhase_Count] = { "SetUp", "TestBody", "TearDown" };
+
+        tTiming.wallTime[phase] = SpGetWallTime() - wallStart;
+        tTiming.cpuTime[phase] = SpGetCpuTime() - cpuStart;
+        SpTraceAdd(NULL, pPhaseName[phase], "phase", wallStart, tTiming.wallTime[phase]);
+    }
+
+private:
+    SpTiming    &tTiming;
+    SpPhase     phase;
+    long long   wallStart;
+    long long   cpuStart;
+};
+
 /******************************************************************************
     Sparrow DB
 ******************************************************************************/
-int SpCaseDB::Register(SpUnit *p)
+int SpCaseDB::Register(SpCaseInfo *p)
 {
-    if (!spudb)
-        spudb = new SPUDB;
-    spudb->cases.push_back(p);
+    p->pNext = NULL;
+    *sgCaseTail = p;
+    sgCaseTail = &p->pNext;
     return 0;
 }
 
-SpUnit* currentUnitCase=NULL;
+SpCaseInfo *SpCaseDB::first()
+{
+    return sgCaseHead;
+}
+
+__thread SpUnit* currentUnitCase=NULL;
 
 namespace Compare {
     std::string ToLower(std::string str)
@@ -63,6 +415,30 @@ namespace Compare {
                 (*it) += 'a'-'A';
         return str;
     }
+
+    static inline char LowerChar(char c)
+    {
+        return ((c>='A') && (c<='Z')) ? c+('a'-'A') : c;
+    }
+
+    int StrCmp(const char *p1, const char *p2, bool blIgnoreCase)
+    {
+        if (!p1 || !p2)
+            return (p1==p2) ? 0 : (p1 ? 1 : -1);
+        if (!blIgnoreCase)
+            return strcmp(p1, p2);
+
+        while (*p1 && LowerChar(*p1)==LowerChar(*p2)) {
+            p1++;
+            p2++;
+        }
+        return (unsigned char)LowerChar(*p1) - (unsigned char)LowerChar(*p2);
+    }
+
+    void ShowStr(const char *p1, const char *p2, const char *expr1, const char *expr2, const char *content, const char *file, int line)
+    {
+        Show2Arg(p1?p1:"(null)", p2?p2:"(null)", expr1, expr2, content, file, line);
+    }
 }
 
 static std::string int2String(int value) {
@@ -71,6 +447,30 @@ static std::string int2String(int value) {
     return abStr;
 }
 
+static std::string long2String(long long value) {
+    char abStr[24];
+    sprintf(abStr, "%lld", value);
+    return abStr;
+}
+
+static std::string double2String(double value) {
+    char abStr[32];
+    sprintf(abStr, "%.3f", value);
+    return abStr;
+}
+
+/* perf counter names, used in console and xml */
+static const char *sgCounterName[SpCounter_Count] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses"
+};
+
+/* ns to seconds */
+static std::string time2String(long long value) {
+    char abStr[32];
+    sprintf(abStr, "%.6f", value/1e9);
+    return abStr;
+}
+
 static bool writeStringToFile(const std::string &tFile, const std::string &tContent) {
     FILE *fp = fopen(tFile.c_str(), "wb");
     if (!fp)
@@ -87,682 +487,3713 @@ static bool writeStringToFile(const std::string &tFile, const std::string &tCont
 ******************************************************************************/
 namespace testing {
     Environment* AddGlobalTestEnvironment(Environment* env) {
-        spudb->env.push_back(env);
+        SpGetDB()->env.push_back(env);
         return env;
     }
 }
 
-class CaseStat {
-public:
-    CaseStat(const std::string &tCase, int runTime, const std::string &tFailMsg) :
-            tCase(tCase), tFailMsg(tFailMsg), runTime(runTime) {}
+struct SpCaseResult {
+    SpCaseResult() : failCount(0), successCount(0) {
+        memset(&tTiming, 0, sizeof(tTiming));
+        memset(&tBenchStat, 0, sizeof(tBenchStat));
+        memset(&tPerfStat, -1, sizeof(tPerfStat));
+        memset(&tAllocStat, 0, sizeof(tAllocStat));
+    }
 
-    std::string genXml(const std::string &tSuiteName) {
-        std::string tXmlStr  = "        <testcase name='" + tCase + "'";
-        tXmlStr += " status='run'";
-        tXmlStr += " time='" + int2String(runTime) + "'";
-        tXmlStr += " classname='" +tSuiteName + "'";
-        if (!tFailMsg.size()) {
-            tXmlStr += " />\n";
-            return tXmlStr;
-        }
+    struct Site {
+        std::string tFile;
+        int         line;
+        int         hits;
+    };
 
-        tXmlStr += ">\n";
-        tXmlStr += "            <failure message='Failed' type=''>";
-        tXmlStr += "<![CDATA[" + tFailMsg + "]]> </failure>\n";
-        tXmlStr += "        </testcase>\n";
-        return tXmlStr;
+    void collect(const SpUnit *p) {
+        tTiming = p->getTiming();
+        tBenchStat = p->getBenchStat();
+        tPerfStat = p->getPerfStat();
+        tAllocStat = p->getAllocStat();
+        failCount = p->getFailCount();
+        successCount = p->getSuccessCount();
+        tFailInfo = p->getFailInfo();
+        tOutput = p->getOutput();
+        tFailSites.resize(p->getFailSites().size());
+        for (size_t i=0; i<tFailSites.size(); i++) {
+            tFailSites[i].tFile = p->getFailSites()[i].pFile;
+            tFailSites[i].line = p->getFailSites()[i].line;
+            tFailSites[i].hits = p->getFailSites()[i].hits;
+        }
     }
 
-    std::string tCase;
-    std::string tFailMsg;
-    int runTime;
+    std::string tSuiteName;
+    std::string tCaseName;
+    SpTiming    tTiming;
+    SpBenchStat tBenchStat;
+    SpPerfStat  tPerfStat;
+    SpAllocStat tAllocStat;
+    int         failCount;
+    int         successCount;
+    std::string tFailInfo;
+    std::string tOutput;            /* captured stdout and stderr */
+    std::vector<Site>   tFailSites;     /* failed assertion sites */
 };
 
-class SuiteStat {
-public:
-    SuiteStat(const std::string &tSuite) :
-            tSuiteName(tSuite), failCount(0), timeCost(0) {}
-
-    void add(const std::string &tCase, int runTime, const std::string &tFailMsg) {
-        tCaseDB.push_back(new CaseStat(tCase, runTime, tFailMsg));
-        timeCost += runTime;
-        if (tFailMsg.size())
-            failCount++;
+/* Text for an xml attribute in single quotes, control characters that xml
+   does not allow are replaced by '?' */
+static void SpXmlEscape(std::string &tOut, const std::string &tIn)
+{
+    for (size_t i=0; i<tIn.size(); i++) {
+        unsigned char c = tIn[i];
+        switch (c) {
+        case '&':   tOut += "&amp;";    break;
+        case '<':   tOut += "&lt;";     break;
+        case '>':   tOut += "&gt;";     break;
+        case '\'':  tOut += "&apos;";   break;
+        case '"':   tOut += "&quot;";   break;
+        case '\n':  tOut += "&#x0A;";   break;
+        default:    tOut += (c<0x20 && c!='\t' && c!='\r') ? '?' : (char)c;
+        }
     }
+}
 
-    ~SuiteStat() {
-        for (size_t i=0, j=tCaseDB.size(); i<j; i++)
-            delete tCaseDB[i];
+/* Text in a CDATA section, "]]>" is split into two sections */
+static void SpXmlCData(std::string &tOut, const std::string &tIn)
+{
+    tOut += "<![CDATA[";
+    for (size_t i=0; i<tIn.size(); i++) {
+        unsigned char c = tIn[i];
+        if (c==']' && tIn.compare(i, 3, "]]>")==0) {
+            tOut += "]]]]><![CDATA[>";
+            i += 2;
+        } else {
+            tOut += (c<0x20 && c!='\t' && c!='\n' && c!='\r') ? '?' : (char)c;
+        }
     }
+    tOut += "]]>";
+}
 
-    std::string genXml() {
-        std::string tXmlStr  = "    <testsuite name='" + tSuiteName + "'";
-        tXmlStr += " tests='" + int2String(tCaseDB.size()) + "'";
-        tXmlStr += " failures='" + int2String(failCount) + "'";
-        tXmlStr += " time='" + int2String(timeCost) + "'>\n";
+typedef std::vector<std::pair<const char*, std::string> > SpCaseFields;
 
-        for (size_t i=0, j=tCaseDB.size(); i<j; i++)
-            tXmlStr += tCaseDB[i]->genXml(tSuiteName);
+/* Measured values of a case, the attributes of the xml and json report */
+static void SpGetCaseFields(SpCaseFields &tFields, const SpCaseResult &tResult)
+{
+    const SpTiming &tTiming = tResult.tTiming;
+    const SpBenchStat &tBenchStat = tResult.tBenchStat;
 
-        tXmlStr += "    </testsuite>\n";
-        return tXmlStr;
+#define _SpAddField(name, value)    tFields.push_back(std::make_pair((const char *)(name), value))
+    _SpAddField("time", time2String(tTiming.totalWall()));
+    _SpAddField("setup_time", time2String(tTiming.wallTime[SpPhase_SetUp]));
+    _SpAddField("body_time", time2String(tTiming.wallTime[SpPhase_TestBody]));
+    _SpAddField("teardown_time", time2String(tTiming.wallTime[SpPhase_TearDown]));
+    _SpAddField("cpu_time", time2String(tTiming.totalCpu()));
+    if (tBenchStat.iterations) {
+        _SpAddField("iterations", long2String(tBenchStat.iterations));
+        _SpAddField("ns_min", double2String(tBenchStat.min));
+        _SpAddField("ns_median", double2String(tBenchStat.median));
+        _SpAddField("ns_mean", double2String(tBenchStat.mean));
+        _SpAddField("ns_p99", double2String(tBenchStat.p99));
+        _SpAddField("ns_stddev", double2String(tBenchStat.stddev));
+    }
+    for (int i=0; i<SpCounter_Count; i++)
+        if (tResult.tPerfStat.value[i] >= 0)
+            _SpAddField(sgCounterName[i], long2String(tResult.tPerfStat.value[i]));
+    /* merged results come from runs that tracked allocations */
+    if (sgAllocTracked || tResult.tAllocStat.count) {
+        _SpAddField("alloc_count", long2String(tResult.tAllocStat.count));
+        _SpAddField("alloc_bytes", long2String(tResult.tAllocStat.bytes));
+        _SpAddField("alloc_peak", long2String(tResult.tAllocStat.peak));
+        _SpAddField("alloc_leaked", long2String(tResult.tAllocStat.leaked));
     }
+#undef _SpAddField
+}
 
-private:
-    std::string             tSuiteName;
-    std::vector<CaseStat*>  tCaseDB;
-    int                     failCount;
-    int                     timeCost;
-};
+static void SpXmlCase(std::string &tXmlStr, const SpCaseResult &tResult)
+{
+    SpCaseFields tFields;
 
-class SpStat {
-public:
-    void addStat(const std::string &tSuite, const std::string &tCase, int runTime, const std::string &tFailMsg="");
-    bool writeFile(const std::string &tFileName);
+    SpGetCaseFields(tFields, tResult);
+    tXmlStr += "        <testcase name='";
+    SpXmlEscape(tXmlStr, tResult.tCaseName);
+    tXmlStr += "' status='run'";
+    for (size_t i=0; i<tFields.size(); i++)
+        tXmlStr += std::string(" ") + tFields[i].first + "='" + tFields[i].second + "'";
+    tXmlStr += " classname='";
+    SpXmlEscape(tXmlStr, tResult.tSuiteName);
+    tXmlStr += "'";
+    if (!tResult.failCount && tResult.tOutput.empty()) {
+        tXmlStr += " />\n";
+        return;
+    }
 
-    static SpStat &getStat() {
-        if (!pStat)
-            pStat = new SpStat;
-        return *pStat;
+    tXmlStr += ">\n";
+    if (tResult.failCount) {
+        tXmlStr += "            <failure message='Failed' type=''>";
+        SpXmlCData(tXmlStr, tResult.tFailInfo);
+        tXmlStr += " </failure>\n";
     }
-    ~SpStat() {
-        std::map<std::string,SuiteStat*>::iterator it = gtSuiteDB.begin();
-        for (; it!=gtSuiteDB.end(); it++)
-            delete it->second;
+    if (tResult.tOutput.size()) {
+        tXmlStr += "            <system-out>";
+        SpXmlCData(tXmlStr, tResult.tOutput);
+        tXmlStr += "</system-out>\n";
+    }
+    tXmlStr += "        </testcase>\n";
+}
+
+/* Registration order, cases of a suite together */
+static void SpSuiteOrder(const std::vector<SpCaseResult> &tResults, std::vector<int> &tOrder)
+{
+    std::map<std::string, size_t> tSuiteIdx;
+    std::vector<std::vector<int> > tSuites;
+
+    for (size_t i=0; i<tResults.size(); i++) {
+        std::map<std::string, size_t>::iterator it = tSuiteIdx.find(tResults[i].tSuiteName);
+        if (it == tSuiteIdx.end()) {
+            it = tSuiteIdx.insert(std::make_pair(tResults[i].tSuiteName, tSuites.size())).first;
+            tSuites.push_back(std::vector<int>());
+        }
+        tSuites[it->second].push_back(i);
     }
 
+    tOrder.clear();
+    for (size_t i=0; i<tSuites.size(); i++)
+        tOrder.insert(tOrder.end(), tSuites[i].begin(), tSuites[i].end());
+}
+
+/******************************************************************************
+    Result xml, written while the run goes on. Cases are written in the order
+    of registration grouped by suite, each one once it and all cases before it
+    are finished. The closing tags after the last case are overwritten by the
+    next one, and the counts in the suite and root tags are rewritten in place
+    (room for the counts is padded by spaces), so the file is complete xml
+    whenever the run stops. Failure messages and captured output are freed
+    once written, unless the json report is written at the end as well.
+******************************************************************************/
+#define SpXmlCountWidth     96      /* counts and name of the root tag */
+
+class SpXmlWriter {
+public:
+    SpXmlWriter() : fp(NULL) {}
+    ~SpXmlWriter() { close(); }
+
+    bool open(const std::string &tFileName, std::vector<SpCaseResult> &tResults, bool blFreeInfo);
+    void done(int idx);
+    void close();
+
 private:
-    SpStat() : caseCount(0), failCount(0), timeCost(0) {}
+    SpXmlWriter(const SpXmlWriter &);
+    SpXmlWriter &operator=(const SpXmlWriter &);
 
-    int caseCount;
-    int failCount;
-    int timeCost;
-    std::map<std::string,SuiteStat*>    gtSuiteDB;
-    static SpStat *pStat;
-};
+    struct Count {
+        int         tests;
+        int         failures;
+        long long   timeCost;
+    };
+
+    void writeCase(int idx);
+    void writeTag(long pos, const std::string &tHead, const Count &tCount);
 
-SpStat *SpStat::pStat = NULL;
+    SpMutex     tLock;
+    FILE        *fp;
+    long        pos;            /* end of the last case */
+    long        suitePos;       /* tag of the open suite */
+    long        rootPos;
+    std::string tSuite;
+    std::string tSuiteHead;     /* suite tag before the counts */
+    Count       tSuiteCount;
+    Count       tRootCount;
+    std::string tXmlStr;
+    std::vector<int>    tOrder;     /* index of cases in writing order */
+    std::vector<bool>   tDone;
+    size_t              next;
+    bool                blFreeInfo;     /* no one else needs the failure messages */
+    std::vector<SpCaseResult>   *pResults;
+};
 
-void SpStat::addStat(const std::string &tSuite, const std::string &tCase, int runTime, const std::string &tFailMsg)
+bool SpXmlWriter::open(const std::string &tFileName, std::vector<SpCaseResult> &tResults, bool blFreeInfo)
 {
-    std::map<std::string,SuiteStat*>::iterator it = gtSuiteDB.find(tSuite);
-    SuiteStat *pSuite;
+    fp = fopen(tFileName.c_str(), "wb");
+    if (!fp) {
+        _SpErrorLog("Open xml file %s failed.\n", tFileName.c_str());
+        return false;
+    }
 
-    if (it == gtSuiteDB.end()) {
-        pSuite = new SuiteStat(tSuite);
-        gtSuiteDB.insert(std::pair<std::string,SuiteStat*>(tSuite, pSuite));
-    } else
-        pSuite = it->second;
+    SpSuiteOrder(tResults, tOrder);
+    pResults = &tResults;
+    tDone.assign(tResults.size(), false);
+    next = 0;
+    this->blFreeInfo = blFreeInfo;
+    memset(&tRootCount, 0, sizeof(tRootCount));
 
-    pSuite->add(tCase, runTime, tFailMsg);
-    timeCost += runTime;
-    caseCount++;
-    if (tFailMsg.size())
-        failCount++;
+    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n", fp);
+    rootPos = ftell(fp);
+    writeTag(rootPos, "<testsuites", tRootCount);
+    pos = ftell(fp);
+    fputs("</testsuites>\n", fp);
+    fflush(fp);
+    return true;
 }
 
-bool SpStat::writeFile(const std::string &tFileName)
+void SpXmlWriter::writeTag(long tagPos, const std::string &tHead, const Count &tCount)
 {
-    string tXmlStr = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    std::string tTag = tHead;
+    tTag += " tests='" + int2String(tCount.tests) + "'";
+    tTag += " failures='" + int2String(tCount.failures) + "'";
+    tTag += " time='" + time2String(tCount.timeCost) + "'";
+    if (tagPos == rootPos)
+        tTag += " name='AllTests'";
+    if (tTag.size() < tHead.size()+SpXmlCountWidth)
+        tTag.append(tHead.size()+SpXmlCountWidth-tTag.size(), ' ');
+    tTag += ">\n";
+
+    fseek(fp, tagPos, SEEK_SET);
+    fwrite(tTag.data(), 1, tTag.size(), fp);
+}
 
-    tXmlStr += "<testsuites";
-    tXmlStr += " tests='" + int2String(caseCount) + "'";
-    tXmlStr += " failures='" + int2String(failCount) + "'";
-    tXmlStr += " time='" + int2String(timeCost) + "'";
-    tXmlStr += " name='AllTests'>\n";
+void SpXmlWriter::writeCase(int idx)
+{
+    SpCaseResult &tResult = (*pResults)[idx];
 
-    std::map<std::string,SuiteStat*>::iterator it = gtSuiteDB.begin();
-    for (; it!=gtSuiteDB.end(); it++)
-        tXmlStr += it->second->genXml();
-    tXmlStr += "</testsuites>\n";
+    tXmlStr.clear();
+    fseek(fp, pos, SEEK_SET);
+    if (tSuite != tResult.tSuiteName) {
+        if (tSuite.size())
+            fputs("    </testsuite>\n", fp);
+        tSuite = tResult.tSuiteName;
+        tSuiteHead = "    <testsuite name='";
+        SpXmlEscape(tSuiteHead, tSuite);
+        tSuiteHead += "'";
+        memset(&tSuiteCount, 0, sizeof(tSuiteCount));
+        suitePos = ftell(fp);
+        writeTag(suitePos, tSuiteHead, tSuiteCount);
+    }
 
-    delete pStat;
-    pStat = NULL;
+    SpXmlCase(tXmlStr, tResult);
+    fwrite(tXmlStr.data(), 1, tXmlStr.size(), fp);
+    pos = ftell(fp);
+    fputs("    </testsuite>\n</testsuites>\n", fp);
 
-    return writeStringToFile(tFileName, tXmlStr);
+    Count *aCount[2] = { &tSuiteCount, &tRootCount };
+    for (int i=0; i<2; i++) {
+        aCount[i]->tests++;
+        aCount[i]->failures += tResult.failCount ? 1 : 0;
+        aCount[i]->timeCost += tResult.tTiming.totalWall();
+    }
+    writeTag(suitePos, tSuiteHead, tSuiteCount);
+    writeTag(rootPos, "<testsuites", tRootCount);
+    if (blFreeInfo) {
+        std::string().swap(tResult.tFailInfo);
+        std::string().swap(tResult.tOutput);
+    }
 }
 
-/******************************************************************************
-    Sparrow Uint main class
-******************************************************************************/
-SpUnit::SpUnit() { reset(); }
-void SpUnit::reset()
+/* The case has its result, thread safe */
+void SpXmlWriter::done(int idx)
 {
-     SuccessTestCount = 0;
-     FailTestCount = 0;
-     tFailInfo.clear();
+    SpAutoLock tAutoLock(tLock);
+    if (!fp)
+        return;
+
+    tDone[idx] = true;
+    bool blWritten = false;
+    for (; next<tOrder.size() && tDone[tOrder[next]]; next++) {
+        writeCase(tOrder[next]);
+        blWritten = true;
+    }
+    if (blWritten)
+        fflush(fp);
 }
 
-bool SpUnit::isMatch(const std::string &filter)
+void SpXmlWriter::close()
 {
-    if (!filter.size())
-        return true;
-    if(tTestCaseName.find(filter) != string::npos)
-        return true;
-    return false;
+    if (!fp)
+        return;
+    fclose(fp);
+    fp = NULL;
 }
 
-int SpUnit::runTest()
+/******************************************************************************
+    Result json, layout of gtest, written when the run is finished
+******************************************************************************/
+static void SpJsonEscape(std::string &tOut, const std::string &tIn)
 {
-    _SpRunLog("\n[ RUN      ] %s.%s\n", tTestSuiteName.c_str(), tTestCaseName.c_str());
-    currentUnitCase = this;
-    time_t tStart = clock();
+    static const char *pHex = "0123456789abcdef";
 
-    try {
-        reset();
-        SetUp();
-        TestBody();
-        TearDown();
-    }
-    catch (...) {
-        _SpErrorLog("Catch assert Fail!!\n");
+    tOut += '"';
+    for (size_t i=0; i<tIn.size(); i++) {
+        unsigned char c = tIn[i];
+        switch (c) {
+        case '"':   tOut += "\\\"";   break;
+        case '\\':  tOut += "\\\\";   break;
+        case '\n':  tOut += "\\n";    break;
+        case '\r':  tOut += "\\r";    break;
+        case '\t':  tOut += "\\t";    break;
+        default:
+            if (c < 0x20) {
+                tOut += "\\u00";
+                tOut += pHex[c>>4];
+                tOut += pHex[c&15];
+            } else {
+                tOut += (char)c;
+            }
+        }
     }
-
-    showResult();
-    time_t tCost = clock()-tStart;
-    SpUnitPrintf(FailTestCount==0?ColorType_Green:ColorType_Red,
-                 "%s %s.%s (%d ms total)\n", FailTestCount==0?"[       OK ]":"[     FAIL ]",
-                 tTestSuiteName.c_str(), tTestCaseName.c_str(), tCost);
-    SpStat::getStat().addStat(tTestSuiteName, tTestCaseName, tCost, tFailInfo);
-    return FailTestCount;
+    tOut += '"';
 }
 
-void SpUnit::addResult(bool blRet)
+static void SpJsonCase(std::string &tJsonStr, const SpCaseResult &tResult)
 {
-    blRet?SuccessTestCount++:FailTestCount++;
+    SpCaseFields tFields;
+
+    SpGetCaseFields(tFields, tResult);
+    tJsonStr += "        { \"name\": ";
+    SpJsonEscape(tJsonStr, tResult.tCaseName);
+    tJsonStr += ", \"status\": \"RUN\"";
+    for (size_t i=0; i<tFields.size(); i++)
+        tJsonStr += std::string(", \"") + tFields[i].first + "\": " + tFields[i].second;
+    tJsonStr += ", \"classname\": ";
+    SpJsonEscape(tJsonStr, tResult.tSuiteName);
+    if (tResult.failCount) {
+        tJsonStr += ",\n          \"failures\": [ { \"failure\": ";
+        SpJsonEscape(tJsonStr, tResult.tFailInfo);
+        tJsonStr += ", \"type\": \"\" } ]";
+    }
+    if (tResult.tOutput.size()) {
+        tJsonStr += ",\n          \"system_out\": ";
+        SpJsonEscape(tJsonStr, tResult.tOutput);
+    }
+    if (tResult.tFailSites.size()) {
+        tJsonStr += ",\n          \"failure_sites\": [";
+        for (size_t i=0; i<tResult.tFailSites.size(); i++) {
+            tJsonStr += i ? ", { \"file\": " : " { \"file\": ";
+            SpJsonEscape(tJsonStr, tResult.tFailSites[i].tFile);
+            tJsonStr += ", \"line\": " + int2String(tResult.tFailSites[i].line);
+            tJsonStr += ", \"hits\": " + int2String(tResult.tFailSites[i].hits) + " }";
+        }
+        tJsonStr += " ]";
+    }
+    tJsonStr += " }";
 }
 
-void SpUnit::showResult() const
+static bool SpJsonSave(const std::string &tFileName, const std::vector<SpCaseResult> &tResults)
 {
-    ColorType tColor = ColorType_Cyan;
-    if (FailTestCount)
-        tColor = (SuccessTestCount==0)?ColorType_Red:ColorType_Yellow;
+    std::vector<int> tOrder;
+    std::string tSuites;
+    int tests = 0, failures = 0;
+    long long timeCost = 0;
 
-    SpUnitPrintf(tColor, "[----------] Case include %d test, success %d, fail %d\n",
-            SuccessTestCount+FailTestCount, SuccessTestCount, FailTestCount);
-}
+    SpSuiteOrder(tResults, tOrder);
+    for (size_t i=0; i<tOrder.size(); ) {
+        const std::string &tSuite = tResults[tOrder[i]].tSuiteName;
+        std::string tCases;
+        int suiteTests = 0, suiteFailures = 0;
+        long long suiteTime = 0;
 
-/******************************************************************************
-    Sparrow console print
+        for (; i<tOrder.size() && tResults[tOrder[i]].tSuiteName==tSuite; i++) {
+            const SpCaseResult &tResult = tResults[tOrder[i]];
+            if (suiteTests++)
+                tCases += ",\n";
+            SpJsonCase(tCases, tResult);
+            suiteFailures += tResult.failCount ? 1 : 0;
+            suiteTime += tResult.tTiming.totalWall();
+        }
+
+        tSuites += tSuites.size() ? ",\n    { \"name\": " : "    { \"name\": ";
+        SpJsonEscape(tSuites, tSuite);
+        tSuites += ", \"tests\": " + int2String(suiteTests);
+        tSuites += ", \"failures\": " + int2String(suiteFailures);
+        tSuites += ", \"time\": " + time2String(suiteTime);
+        tSuites += ", \"testsuite\": [\n" + tCases + "\n      ] }";
+        tests += suiteTests;
+        failures += suiteFailures;
+        timeCost += suiteTime;
+    }
+
+    std::string tJsonStr = "{\n  \"tests\": " + int2String(tests);
+    tJsonStr += ", \"failures\": " + int2String(failures);
+    tJsonStr += ", \"time\": " + time2String(timeCost);
+    tJsonStr += ", \"name\": \"AllTests\",\n  \"testsuites\": [\n" + tSuites + "\n  ]\n}\n";
+    if (!writeStringToFile(tFileName, tJsonStr)) {
+        _SpErrorLog("Open json file %s failed.\n", tFileName.c_str());
+        return false;
+    }
+    return true;
+}
+
+/******************************************************************************
+    Binary result file, the file head and then a record of each case in the
+    order the cases finish, native byte order:
+        file head:  "SpUnitR1"[size of record head][reserved]
+        record:     [SpBinHead][suite][case][failure info][output][site]...
+        site:       [line][hits][file length][file]
+    Records are padded to 8 bytes, so the record heads of a mapped file are
+    aligned. Records are only appended, a run that crashed leaves the records
+    of all cases it finished. The same record is sent by fork shards.
 ******************************************************************************/
-void SpSetConsoleColor(ColorType t)
+#define SpBinMagic      "SpUnitR1"
+#define SpBinFileHead   16
+
+struct SpBinHead {
+    unsigned int    size;       /* whole record, padding included */
+    unsigned int    infoLen;
+    unsigned int    outLen;
+    unsigned short  suiteLen;
+    unsigned short  caseLen;
+    unsigned int    siteCount;
+    int             failCount;
+    int             successCount;
+    SpTiming        tTiming;
+    SpBenchStat     tBenchStat;
+    SpPerfStat      tPerfStat;
+    SpAllocStat     tAllocStat;
+};
+
+static void SpBinEncode(std::string &tOut, const SpCaseResult &tRes)
 {
-#ifdef __MINGW32__
-    HANDLE consolehwnd;
-    unsigned short wColor = FOREGROUND_RED |
-                            FOREGROUND_GREEN |
-                            FOREGROUND_BLUE;
-    switch (t)
-    {
-    case ColorType_Green:
-        wColor = FOREGROUND_GREEN;
-        break;
-    case ColorType_Red:
-        wColor = FOREGROUND_RED;
-        break;
-    case ColorType_Yellow:
-        wColor = FOREGROUND_RED | FOREGROUND_GREEN;
-        break;
-    case ColorType_Cyan:
-        wColor = FOREGROUND_GREEN | FOREGROUND_BLUE;
-        break;
-    default:
-        break;
-    }
-
-    if (t != ColorType_White)
-        wColor |= FOREGROUND_INTENSITY;
-
-    consolehwnd = GetStdHandle(STD_OUTPUT_HANDLE);
-    SetConsoleTextAttribute(consolehwnd, wColor);
-#else
-    switch (t)
-    {
-    case ColorType_Green:
-        printf("\033[1;32m");
-        return;
-    case ColorType_Red:
-        printf("\033[1;31m");
-        return;
-    case ColorType_Yellow:
-        printf("\033[1;33m");
+    SpBinHead tHead;
+    size_t start = tOut.size();
+
+    memset(&tHead, 0, sizeof(tHead));
+    tHead.infoLen = tRes.tFailInfo.size();
+    tHead.outLen = tRes.tOutput.size();
+    tHead.suiteLen = std::min(tRes.tSuiteName.size(), (size_t)0xFFFF);
+    tHead.caseLen = std::min(tRes.tCaseName.size(), (size_t)0xFFFF);
+    tHead.siteCount = tRes.tFailSites.size();
+    tHead.failCount = tRes.failCount;
+    tHead.successCount = tRes.successCount;
+    tHead.tTiming = tRes.tTiming;
+    tHead.tBenchStat = tRes.tBenchStat;
+    tHead.tPerfStat = tRes.tPerfStat;
+    tHead.tAllocStat = tRes.tAllocStat;
+
+    tOut.append((const char *)&tHead, sizeof(tHead));
+    tOut.append(tRes.tSuiteName, 0, tHead.suiteLen);
+    tOut.append(tRes.tCaseName, 0, tHead.caseLen);
+    tOut += tRes.tFailInfo;
+    tOut += tRes.tOutput;
+    for (size_t i=0; i<tRes.tFailSites.size(); i++) {
+        int aSite[3] = { tRes.tFailSites[i].line, tRes.tFailSites[i].hits, (int)tRes.tFailSites[i].tFile.size() };
+        tOut.append((const char *)aSite, sizeof(aSite));
+        tOut += tRes.tFailSites[i].tFile;
+    }
+    tOut.append((8-(tOut.size()-start)%8)%8, '\0');
+
+    unsigned int size = tOut.size() - start;
+    memcpy(&tOut[start], &size, sizeof(size));
+}
+
+/* Record at p, returns its size, 0 if it is not complete */
+static size_t SpBinDecode(const char *p, size_t len, SpCaseResult &tRes)
+{
+    SpBinHead tHead;
+
+    if (len < sizeof(tHead))
+        return 0;
+    memcpy(&tHead, p, sizeof(tHead));
+    if (tHead.size<sizeof(tHead) || tHead.size>len ||
+        tHead.size-sizeof(tHead) < (size_t)tHead.suiteLen+tHead.caseLen+tHead.infoLen+tHead.outLen)
+        return 0;
+
+    const char *pEnd = p + tHead.size;
+    p += sizeof(tHead);
+    tRes.tSuiteName.assign(p, tHead.suiteLen);
+    p += tHead.suiteLen;
+    tRes.tCaseName.assign(p, tHead.caseLen);
+    p += tHead.caseLen;
+    tRes.tFailInfo.assign(p, tHead.infoLen);
+    p += tHead.infoLen;
+    tRes.tOutput.assign(p, tHead.outLen);
+    p += tHead.outLen;
+    tRes.tFailSites.clear();
+    for (unsigned int i=0; i<tHead.siteCount; i++) {
+        int aSite[3];
+        if (pEnd-p < (long)sizeof(aSite))
+            return 0;
+        memcpy(aSite, p, sizeof(aSite));
+        p += sizeof(aSite);
+        if (aSite[2]<0 || pEnd-p < aSite[2])
+            return 0;
+
+        SpCaseResult::Site tSite;
+        tSite.tFile.assign(p, aSite[2]);
+        tSite.line = aSite[0];
+        tSite.hits = aSite[1];
+        tRes.tFailSites.push_back(tSite);
+        p += aSite[2];
+    }
+
+    tRes.failCount = tHead.failCount;
+    tRes.successCount = tHead.successCount;
+    tRes.tTiming = tHead.tTiming;
+    tRes.tBenchStat = tHead.tBenchStat;
+    tRes.tPerfStat = tHead.tPerfStat;
+    tRes.tAllocStat = tHead.tAllocStat;
+    return tHead.size;
+}
+
+class SpBinWriter {
+public:
+    SpBinWriter() : fp(NULL) {}
+    ~SpBinWriter() { close(); }
+
+    bool open(const std::string &tFileName);
+    void add(const SpCaseResult &tRes);
+    void close();
+
+private:
+    SpBinWriter(const SpBinWriter &);
+    SpBinWriter &operator=(const SpBinWriter &);
+
+    SpMutex     tLock;
+    FILE        *fp;
+    std::string tRecord;
+};
+
+bool SpBinWriter::open(const std::string &tFileName)
+{
+    unsigned int aHead[2] = { sizeof(SpBinHead), 0 };
+
+    fp = fopen(tFileName.c_str(), "wb");
+    if (!fp) {
+        _SpErrorLog("Open result file %s failed.\n", tFileName.c_str());
+        return false;
+    }
+    fwrite(SpBinMagic, 1, 8, fp);
+    fwrite(aHead, 1, sizeof(aHead), fp);
+    fflush(fp);
+    return true;
+}
+
+/* One write of the whole record, thread safe */
+void SpBinWriter::add(const SpCaseResult &tRes)
+{
+    SpAutoLock tAutoLock(tLock);
+    if (!fp)
         return;
-    case ColorType_Cyan:
-        printf("\033[1;36m");
+
+    tRecord.clear();
+    SpBinEncode(tRecord, tRes);
+    fwrite(tRecord.data(), 1, tRecord.size(), fp);
+    fflush(fp);
+}
+
+void SpBinWriter::close()
+{
+    if (!fp)
         return;
+    fclose(fp);
+    fp = NULL;
+}
+
+static bool SpBinParse(const std::string &tFileName, const char *p, size_t len, std::vector<SpCaseResult> &tResults)
+{
+    unsigned int headSize;
+
+    if (len<SpBinFileHead || memcmp(p, SpBinMagic, 8)) {
+        _SpErrorLog("%s is not a result file.\n", tFileName.c_str());
+        return false;
     }
-    printf("\033[m");  // Resets the terminal to default.
+    memcpy(&headSize, p+8, sizeof(headSize));
+    if (headSize != sizeof(SpBinHead)) {
+        _SpErrorLog("%s is written by another build of SparrowUnit.\n", tFileName.c_str());
+        return false;
+    }
+
+    size_t pos = SpBinFileHead;
+    while (pos < len) {
+        tResults.push_back(SpCaseResult());
+        size_t size = SpBinDecode(p+pos, len-pos, tResults.back());
+        if (!size) {
+            tResults.pop_back();
+            _SpWarnLog("%s: broken record at offset %ld, the rest is ignored.\n", tFileName.c_str(), (long)pos);
+            break;
+        }
+        pos += size;
+    }
+    return true;
+}
+
+/* Append the records of a result file to tResults, the file is mapped */
+static bool SpBinLoad(const std::string &tFileName, std::vector<SpCaseResult> &tResults)
+{
+#ifndef __MINGW32__
+    struct stat tStat;
+    int fd = open(tFileName.c_str(), O_RDONLY);
+    if (fd<0 || fstat(fd, &tStat)) {
+        _SpErrorLog("Open result file %s failed.\n", tFileName.c_str());
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t len = tStat.st_size;
+    void *p = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (p == MAP_FAILED) {
+        _SpErrorLog("Map result file %s failed.\n", tFileName.c_str());
+        return false;
+    }
+
+    bool blRet = SpBinParse(tFileName, (const char *)p, len, tResults);
+    if (p)
+        munmap(p, len);
+    return blRet;
+#else
+    FILE *fp = fopen(tFileName.c_str(), "rb");
+    if (!fp) {
+        _SpErrorLog("Open result file %s failed.\n", tFileName.c_str());
+        return false;
+    }
+
+    std::string tData;
+    char abBuf[65536];
+    size_t len;
+    while ((len = fread(abBuf, 1, sizeof(abBuf), fp)) > 0)
+        tData.append(abBuf, len);
+    fclose(fp);
+    return SpBinParse(tFileName, tData.data(), tData.size(), tResults);
 #endif
 }
 
-void SpUnitPrintf(ColorType Color, const char *pFormat, ...)
+/******************************************************************************
+    Timing database, run time of each case from last run, one line per case:
+        Suite.Case time(ns)
+******************************************************************************/
+class SpTimingDB {
+public:
+    SpTimingDB() : avgTime(0) {}
+
+    bool load(const std::string &tFileName);
+    bool save(const std::string &tFileName) const;
+
+    void set(const std::string &tKey, long long runTime) { tTimeDB[tKey] = runTime; }
+    long long get(const std::string &tKey) const;
+    bool find(const std::string &tKey, long long &value) const;
+    bool empty() const { return tTimeDB.empty(); }
+
+private:
+    std::map<std::string,long long> tTimeDB;
+    long long                       avgTime;
+};
+
+static SpTimingDB gTimingDB;
+static SpTimingDB gBaselineDB;      /* same format, key is Suite.Case:key */
+
+bool SpTimingDB::load(const std::string &tFileName)
 {
-    static char  sPrtBuf[65536] = {0};
+    FILE *fp = fopen(tFileName.c_str(), "rb");
+    if (!fp)
+        return false;
 
-    register int __retval;
-    __builtin_va_list __local_argv; __builtin_va_start( __local_argv, pFormat );
-    __retval = vsnprintf( sPrtBuf, 65535, (char *)pFormat, __local_argv );
-    sPrtBuf[__retval] = '\0';
-    __builtin_va_end( __local_argv );
+    char abLine[1024];
+    while (fgets(abLine, sizeof(abLine), fp)) {
+        char *pSep = strrchr(abLine, ' ');
+        if (!pSep)
+            continue;
+        *pSep = '\0';
+        tTimeDB[abLine] = strtoll(pSep+1, NULL, 10);
+    }
+    fclose(fp);
+
+    long long sum = 0;
+    std::map<std::string,long long>::const_iterator it = tTimeDB.begin();
+    for (; it!=tTimeDB.end(); it++)
+        sum += it->second;
+    if (tTimeDB.size())
+        avgTime = sum/tTimeDB.size();
+    return true;
+}
 
-    if (Color != ColorType_White)
-        SpSetConsoleColor(Color);
+bool SpTimingDB::save(const std::string &tFileName) const
+{
+    std::string tContent;
+    std::map<std::string,long long>::const_iterator it = tTimeDB.begin();
+    for (; it!=tTimeDB.end(); it++)
+        tContent += it->first + " " + long2String(it->second) + "\n";
+    return writeStringToFile(tFileName, tContent);
+}
 
-    printf(sPrtBuf);
-    SpSetConsoleColor(ColorType_White);
+/* Case never seen before is expected to take the average time */
+long long SpTimingDB::get(const std::string &tKey) const
+{
+    std::map<std::string,long long>::const_iterator it = tTimeDB.find(tKey);
+    return (it != tTimeDB.end()) ? it->second : avgTime;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////
+bool SpTimingDB::find(const std::string &tKey, long long &value) const
+{
+    std::map<std::string,long long>::const_iterator it = tTimeDB.find(tKey);
+    if (it == tTimeDB.end())
+        return false;
+    value = it->second;
+    return true;
+}
 
 /******************************************************************************
-    Mocker interface
+    Hardware performance counters, linux perf events of the running thread
 ******************************************************************************/
-#define _SpMockInvalidSlotId     ((int)-1)
-#define _SpMockSlots             32
-#define _SpMockRetAlways        -1
-#define _SpMockMaxArgs          8
+class SpPerfCounter {
+public:
+    SpPerfCounter(SpPerfStat &t);
+    ~SpPerfCounter();
 
-/* x86 instruction */
-#define FLATJMPCODE_LENGTH      5
-#define FLATJMPCMD_LENGTH       1
-#define FLATJMPCMD              0xe9
+    static void closeThread();      /* close the counters of this thread */
+    static bool blEnabled;
 
-#ifndef PAGESIZE
-#define PAGESIZE 4096
-#endif
+private:
+    SpPerfStat  &tStat;
+};
 
-static int MockGetSlot();
-static void MockFreeSlot(int slot);
-static SpMockImp *SpGetMockImp(void *pFunc);
-static int sgMockFlag = 0;
+bool SpPerfCounter::blEnabled = false;
+
+#ifdef __linux__
+/* Counters are opened once per thread and kept, only reset for each case;
+   a worker closes them when the queue is empty */
+static __thread int     sgPerfFd[SpCounter_Count];
+static __thread bool    sgPerfOpened = false;
+
+static int SpPerfOpen(unsigned int type, unsigned long long config)
+{
+    struct perf_event_attr tAttr;
+    memset(&tAttr, 0, sizeof(tAttr));
+    tAttr.size = sizeof(tAttr);
+    tAttr.type = type;
+    tAttr.config = config;
+    tAttr.disabled = 1;
+    tAttr.exclude_kernel = 1;
+    tAttr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &tAttr, 0, -1, -1, 0);
+}
+
+static void SpPerfOpenAll()
+{
+    const unsigned long long l1dMiss = PERF_COUNT_HW_CACHE_L1D |
+                                       (PERF_COUNT_HW_CACHE_OP_READ<<8) |
+                                       (PERF_COUNT_HW_CACHE_RESULT_MISS<<16);
+
+    sgPerfFd[SpCounter_Cycles] = SpPerfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    sgPerfFd[SpCounter_Instructions] = SpPerfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    sgPerfFd[SpCounter_BranchMisses] = SpPerfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    sgPerfFd[SpCounter_L1DMisses] = SpPerfOpen(PERF_TYPE_HW_CACHE, l1dMiss);
+    sgPerfFd[SpCounter_LLCMisses] = SpPerfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    sgPerfOpened = true;
+}
+
+SpPerfCounter::SpPerfCounter(SpPerfStat &t) : tStat(t)
+{
+    if (!blEnabled)
+        return;
+    if (!sgPerfOpened)
+        SpPerfOpenAll();
+
+    for (int i=0; i<SpCounter_Count; i++) {
+        if (sgPerfFd[i] < 0)
+            continue;
+        ioctl(sgPerfFd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(sgPerfFd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+SpPerfCounter::~SpPerfCounter()
+{
+    if (!blEnabled)
+        return;
+
+    for (int i=0; i<SpCounter_Count; i++) {
+        if (sgPerfFd[i] < 0)
+            continue;
+        ioctl(sgPerfFd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(sgPerfFd[i], &tStat.value[i], sizeof(tStat.value[i])) != sizeof(tStat.value[i]))
+            tStat.value[i] = -1;
+    }
+}
+
+void SpPerfCounter::closeThread()
+{
+    if (!sgPerfOpened)
+        return;
+    for (int i=0; i<SpCounter_Count; i++)
+        if (sgPerfFd[i] >= 0)
+            close(sgPerfFd[i]);
+    sgPerfOpened = false;
+}
+#else
+SpPerfCounter::SpPerfCounter(SpPerfStat &t) : tStat(t) {}
+SpPerfCounter::~SpPerfCounter() {}
+void SpPerfCounter::closeThread() {}
+#endif
 
 /******************************************************************************
-    Mocker implement
+    Allocation tracking, build with SP_ALLOC_TRACK to enable. On glibc malloc
+    family is replaced, so C code is counted too; on MinGW operator new/delete
+    is replaced. Only the thread that runs the case is counted.
 ******************************************************************************/
-class SpMockImp {
-public:
-    SpMockImp();
+struct SpAllocBlock {
+    void        *p;
+    size_t      n;
+};
 
-    int     getRet();
-    void    getArg(void *p0, void *p1, void *p2, void *p3, void *p4, void *p5, void *p6, void *p7);
+/* Blocks of the watched case are kept in an open addressing table, so a free
+   only counts for a block the case allocated itself */
+struct SpAllocCounter {
+    long long       count;
+    long long       bytes;
+    long long       live;
+    long long       peak;
+    SpAllocBlock    *pBlocks;
+    size_t          slots;      /* power of 2 */
+    size_t          used;
+};
 
-    void    setSlot(int slot);
-    void    hook(void *pHook);
-    void    reset();
-    void    addRet(int value, int times);
-    bool    match(void *pFunc) { return pHookFunc==pFunc; }
-    bool    repArg(int no, void *prep, int len);
+static __thread SpAllocCounter sgAlloc;
+static __thread int  sgAllocPaused;
+static __thread bool sgAllocWatched;
 
-private:
-    bool    hookApi(void* ApiFun, void* HookFun);
-    bool    unhookApi(void* ApiFun);
+SpAllocPause::SpAllocPause() { sgAllocPaused++; }
+SpAllocPause::~SpAllocPause() { sgAllocPaused--; }
 
-private:
-    void*       pHookFunc;
-    bool        blAlwaysRet;
-    int         retValue;
-    int         slot;
+static inline size_t SpBlockSize(void *p)
+{
+#if defined(__GLIBC__)
+    return malloc_usable_size(p);
+#elif defined(__MINGW32__)
+    return _msize(p);
+#else
+    return 0;
+#endif
+}
 
-    BYTE        ApiBackup[FLATJMPCODE_LENGTH];  /* code backup */
-    list<int>   tRetDB;
-    void*       apArgRepVal[_SpMockMaxArgs];
-    int         adwArgLen[_SpMockMaxArgs];
+static inline size_t SpBlockSlot(const void *p, size_t slots)
+{
+    return (size_t)(((unsigned long long)(size_t)p >> 4) * 0x9E3779B97F4A7C15ULL >> 32) & (slots-1);
+}
+
+static void SpBlockInsert(SpAllocBlock *pBlocks, size_t slots, void *p, size_t n)
+{
+    size_t i = SpBlockSlot(p, slots);
+    while (pBlocks[i].p)
+        i = (i+1) & (slots-1);
+    pBlocks[i].p = p;
+    pBlocks[i].n = n;
+}
+
+/* called paused, the table itself is not counted */
+static void SpBlockGrow()
+{
+    size_t slots = sgAlloc.slots ? sgAlloc.slots*2 : 1024;
+    SpAllocBlock *pBlocks = (SpAllocBlock *)calloc(slots, sizeof(SpAllocBlock));
+    if (!pBlocks)
+        return;
+    for (size_t i=0; i<sgAlloc.slots; i++)
+        if (sgAlloc.pBlocks[i].p)
+            SpBlockInsert(pBlocks, slots, sgAlloc.pBlocks[i].p, sgAlloc.pBlocks[i].n);
+    free(sgAlloc.pBlocks);
+    sgAlloc.pBlocks = pBlocks;
+    sgAlloc.slots = slots;
+}
+
+/* size of the block if the case allocated it, it is then removed; the
+   following entries of the probe chain are shifted back into the gap */
+static bool SpBlockRemove(void *p, size_t &n)
+{
+    size_t mask = sgAlloc.slots-1;
+    size_t i = SpBlockSlot(p, sgAlloc.slots);
+    while (sgAlloc.pBlocks[i].p != p) {
+        if (!sgAlloc.pBlocks[i].p)
+            return false;
+        i = (i+1) & mask;
+    }
+    n = sgAlloc.pBlocks[i].n;
+    sgAlloc.used--;
+
+    for (size_t j=(i+1)&mask; sgAlloc.pBlocks[j].p; j=(j+1)&mask) {
+        size_t k = SpBlockSlot(sgAlloc.pBlocks[j].p, sgAlloc.slots);
+        if (((j-k) & mask) >= ((j-i) & mask)) {
+            sgAlloc.pBlocks[i] = sgAlloc.pBlocks[j];
+            i = j;
+        }
+    }
+    sgAlloc.pBlocks[i].p = NULL;
+    return true;
+}
+
+void SpAllocAdd(void *p)
+{
+    if (!p || sgAllocPaused)
+        return;
+    size_t n = SpBlockSize(p);
+    sgAlloc.count++;
+    sgAlloc.bytes += n;
+    if (!sgAllocWatched)
+        return;
+
+    SpAllocPause tPause;
+    if ((sgAlloc.used+1)*2 > sgAlloc.slots)
+        SpBlockGrow();
+    if ((sgAlloc.used+1)*2 > sgAlloc.slots)
+        return;
+    SpBlockInsert(sgAlloc.pBlocks, sgAlloc.slots, p, n);
+    sgAlloc.used++;
+    sgAlloc.live += n;
+    if (sgAlloc.live > sgAlloc.peak)
+        sgAlloc.peak = sgAlloc.live;
+}
+
+void SpAllocDel(void *p)
+{
+    size_t n;
+    if (p && sgAlloc.used && SpBlockRemove(p, n))
+        sgAlloc.live -= n;
+}
+
+/* blocks still in the table when the case ends are the ones it did not free */
+class SpAllocWatch {
+public:
+    SpAllocWatch(SpAllocStat &t) : tStat(t), startCount(sgAlloc.count), startBytes(sgAlloc.bytes) {
+        sgAlloc.live = sgAlloc.peak = 0;
+        sgAllocWatched = true;
+    }
+    ~SpAllocWatch() {
+        sgAllocWatched = false;
+        tStat.count = sgAlloc.count - startCount;
+        tStat.bytes = sgAlloc.bytes - startBytes;
+        tStat.peak = sgAlloc.peak;
+        tStat.leaked = sgAlloc.used;
+
+        SpAllocBlock *pBlocks = sgAlloc.pBlocks;
+        sgAlloc.pBlocks = NULL;
+        sgAlloc.slots = sgAlloc.used = 0;
+        SpAllocPause tPause;
+        free(pBlocks);
+    }
 
 private:
-    static void *sgMockFuncSlot[_SpMockSlots];
+    SpAllocStat     &tStat;
+    long long       startCount;
+    long long       startBytes;
 };
 
-SpMockImp::SpMockImp() : pHookFunc(NULL) { reset(); }
-void SpMockImp::setSlot(int slot) { this->slot = slot; }
-void SpMockImp::reset()
+SpAllocScope::SpAllocScope(long long maxAllocs, SpAssertSite *pSite, bool blAssert) :
+        maxAllocs(maxAllocs), startCount(sgAlloc.count), pSite(pSite),
+        blAssert(blAssert), blDone(false) {}
+
+bool SpAllocScope::once()
 {
-    if (pHookFunc) {
-        unhookApi(pHookFunc);
-        MockFreeSlot(slot);
+    if (!blDone) {
+        blDone = true;
+        startCount = sgAlloc.count;
+        return true;
+    }
+
+    long long count = sgAlloc.count - startCount;
+    SpAllocPause tPause;
+    if (!sgAllocTracked) {
+        static int warned = 0;
+        if (!__sync_lock_test_and_set(&warned, 1))
+            _SpWarnLog("Allocation tracking is not built in, build SparrowUnit with SP_ALLOC_TRACK.\n");
+    }
+
+    bool blRet = count <= maxAllocs;
+    SpSiteResult(*pSite, blRet);
+    if (!blRet && Compare::KeepFailure(pSite->pFile, pSite->line)) {
+        std::stringstream tStrStream;
+        tStrStream << pSite->pFile << ":" << pSite->line << " Failure" << std::endl;
+        tStrStream << "Scope expect at most [ " << maxAllocs << " ] allocations" << std::endl;
+        tStrStream << "Allocations = [" << count << "]" << std::endl;
+        Compare::ReportFailure(tStrStream.str());
+    }
+
+    if (currentUnitCase)
+        currentUnitCase->addResult(blRet);
+    if (!blRet && blAssert)
+        throw 1;
+    return false;
+}
+
+/******************************************************************************
+    Sparrow Uint main class
+******************************************************************************/
+/* console log of a case, see Sparrow console print */
+static void SpLogCaseBegin();
+static void SpLogCaseEnd(bool blFailed);
+static void SpLogSync();
+
+/* stdout and stderr of a case, see Output capture */
+static void SpCaptureBegin(std::string *pOut);
+static void SpCaptureEnd();
+
+/* Failure recording limits of each case, set by SpUnitInit */
+static int      sgFailMessages = 10;        /* full messages kept of each assertion site */
+static size_t   sgFailInfoLimit = 1<<20;    /* bytes of failure messages kept */
+static int      sgFailPrintLimit = 100;     /* failure messages printed to console */
+static int      sgCaseFailLimit = 0;        /* stop the case after so many failures, 0 never */
+
+SpUnit::SpUnit() { reset(); }
+void SpUnit::reset()
+{
+     SuccessTestCount = 0;
+     FailTestCount = 0;
+     memset(&tTiming, 0, sizeof(tTiming));
+     memset(&tBenchStat, 0, sizeof(tBenchStat));
+     memset(&tPerfStat, -1, sizeof(tPerfStat));
+     memset(&tAllocStat, 0, sizeof(tAllocStat));
+     tFailInfo.clear();
+     tOutput.clear();
+     tFailSites.clear();
+     lastSite = 0;
+     printCount = 0;
+     blInfoFull = false;
+}
+
+int SpUnit::runTest()
+{
+    SpLogCaseBegin();
+    _SpRunLog("\n[ RUN      ] %s.%s\n", tTestSuiteName.c_str(), tTestCaseName.c_str());
+    SpLogSync();
+    currentUnitCase = this;
+    reset();
+    SpCaptureBegin(&tOutput);
+
+    {
+        SpAllocWatch tAllocWatch(tAllocStat);
+        try {
+            { SpPhaseTimer t(tTiming, SpPhase_SetUp);       SetUp(); }
+            { SpPhaseTimer t(tTiming, SpPhase_TestBody);    SpPerfCounter c(tPerfStat);    TestBody(); }
+            { SpPhaseTimer t(tTiming, SpPhase_TearDown);    TearDown(); }
+        }
+        catch (...) {
+            _SpErrorLog("Catch assert Fail!!\n");
+        }
+    }
+    SpCaptureEnd();
+    showFailSites();
+
+    showResult();
+    if (tBenchStat.iterations)
+        SpUnitPrintf(ColorType_Cyan, "[  BENCH   ] %lld iterations, ns per iteration: min %.1f, median %.1f, mean %.1f, p99 %.1f, stddev %.1f\n",
+                     tBenchStat.iterations, tBenchStat.min, tBenchStat.median, tBenchStat.mean, tBenchStat.p99, tBenchStat.stddev);
+    if (SpPerfCounter::blEnabled) {
+        std::string tCounters;
+        for (int i=0; i<SpCounter_Count; i++)
+            if (tPerfStat.value[i] >= 0)
+                tCounters += std::string(" ") + sgCounterName[i] + " " + long2String(tPerfStat.value[i]);
+        if (tCounters.size())
+            SpUnitPrintf(ColorType_Cyan, "[  PERF    ]%s\n", tCounters.c_str());
+    }
+    if (sgAllocTracked)
+        SpUnitPrintf(tAllocStat.leaked?ColorType_Yellow:ColorType_Cyan,
+                     "[  ALLOC   ] %lld allocations, %lld bytes, peak %lld bytes, %lld not freed\n",
+                     tAllocStat.count, tAllocStat.bytes, tAllocStat.peak, tAllocStat.leaked);
+    if (FailTestCount && tOutput.size())
+        SpUnitPrintf(ColorType_White, "[  OUTPUT  ] %d bytes written by the case:\n%s%s", (int)tOutput.size(),
+                     tOutput.c_str(), tOutput[tOutput.size()-1]=='\n' ? "" : "\n");
+    currentUnitCase = NULL;
+    SpUnitPrintf(FailTestCount==0?ColorType_Green:ColorType_Red,
+                 "%s %s.%s (%.3f ms total, SetUp %.3f, TestBody %.3f, TearDown %.3f, cpu %.3f ms)\n",
+                 FailTestCount==0?"[       OK ]":"[     FAIL ]",
+                 tTestSuiteName.c_str(), tTestCaseName.c_str(), tTiming.totalWall()/1e6,
+                 tTiming.wallTime[SpPhase_SetUp]/1e6, tTiming.wallTime[SpPhase_TestBody]/1e6,
+                 tTiming.wallTime[SpPhase_TearDown]/1e6, tTiming.totalCpu()/1e6);
+    SpLogCaseEnd(FailTestCount != 0);
+    return FailTestCount;
+}
+
+void SpUnit::addResult(bool blRet)
+{
+    blRet?SuccessTestCount++:FailTestCount++;
+    if (!blRet && FailTestCount == sgCaseFailLimit) {
+        SpAllocPause tPause;
+        std::string tInfo = "Case stopped after " + int2String(FailTestCount) + " failures.\n";
+        tFailInfo += tInfo;
+        _SpErrorLog("%s", tInfo.c_str());
+        throw 1;
+    }
+}
+
+static inline bool SpSameSite(const char *pFile1, int line1, const char *pFile2, int line2)
+{
+    return line1==line2 && (pFile1==pFile2 || !strcmp(pFile1, pFile2));
+}
+
+/* Count a failure of the site, true if its full message is still wanted */
+bool SpUnit::addFailSite(const char *pFile, int line)
+{
+    if (lastSite>=tFailSites.size() || !SpSameSite(tFailSites[lastSite].pFile, tFailSites[lastSite].line, pFile, line)) {
+        for (lastSite=0; lastSite<tFailSites.size(); lastSite++)
+            if (SpSameSite(tFailSites[lastSite].pFile, tFailSites[lastSite].line, pFile, line))
+                break;
+        if (lastSite == tFailSites.size()) {
+            FailSite tSite = { pFile, line, 0 };
+            tFailSites.push_back(tSite);
+        }
+    }
+    return ++tFailSites[lastSite].hits<=sgFailMessages && !blInfoFull;
+}
+
+/* Keep the message while the case is under its byte limit, true if it
+   should be printed to console as well */
+bool SpUnit::addFailInfo(const std::string &tErr)
+{
+    if (tFailInfo.size()+tErr.size() <= sgFailInfoLimit) {
+        tFailInfo += tErr;
+    } else if (!blInfoFull) {
+        blInfoFull = true;
+        tFailInfo += "Failure messages over " + long2String(sgFailInfoLimit) + " bytes are dropped.\n";
+    }
+
+    if (++printCount == sgFailPrintLimit+1)
+        _SpWarnLog("Over %d failure messages, the rest are not printed.\n", sgFailPrintLimit);
+    return printCount <= sgFailPrintLimit;
+}
+
+/* Hit count of the sites whose messages were not all kept */
+void SpUnit::showFailSites()
+{
+    for (size_t i=0; i<tFailSites.size(); i++) {
+        if (tFailSites[i].hits<=sgFailMessages && !blInfoFull)
+            continue;
+        std::string tInfo = std::string(tFailSites[i].pFile) + ":" + int2String(tFailSites[i].line) +
+                            " failed " + int2String(tFailSites[i].hits) + " times\n";
+        tFailInfo += tInfo;
+        _SpWarnLog("%s", tInfo.c_str());
+    }
+}
+
+bool Compare::KeepFailure(const char *file, int line)
+{
+    return currentUnitCase ? currentUnitCase->addFailSite(file, line) : true;
+}
+
+void Compare::ReportFailure(const std::string &tInfo)
+{
+    if (!currentUnitCase || currentUnitCase->addFailInfo(tInfo))
+        SpUnitPrintf(ColorType_Red, "%s", tInfo.c_str());
+}
+
+void SpUnit::showResult() const
+{
+    ColorType tColor = ColorType_Cyan;
+    if (FailTestCount)
+        tColor = (SuccessTestCount==0)?ColorType_Red:ColorType_Yellow;
+
+    SpUnitPrintf(tColor, "[----------] Case include %d test, success %d, fail %d\n",
+            SuccessTestCount+FailTestCount, SuccessTestCount, FailTestCount);
+}
+
+/******************************************************************************
+    Sparrow console print
+******************************************************************************/
+/* Console output is kept in a buffer of each thread and written to stdout by
+   write(2) in large blocks: when the buffer is full, when a case ends, or at
+   once if stdout is a terminal. The output of a held case (a case on a worker
+   thread, or any case with --quiet or --only-failures) is only written when
+   the case ends, so parallel cases never interleave and a passing case can be
+   dropped. A thread without buffer, e.g. one started by a case, writes each
+   message at once. */
+#define SpLogBlock      (64*1024)
+
+class SpLogBuf {
+public:
+    SpLogBuf(bool blHold) : blHold(blHold), blInCase(false) {}
+
+    std::string tData;
+    bool        blHold;         /* hold output of a case until it ends */
+    bool        blInCase;
+};
+
+static SpMutex  sgConsoleLock;
+static __thread SpLogBuf *sgLogBuf = NULL;
+static SpLogBuf sgMainLog(false);
+static bool     sgLogTty = false;
+static bool     sgLogColor = false;
+static bool     sgLogQuiet = false;
+static bool     sgLogOnlyFailures = false;
+
+static const char *sgColorCode[] = { "\033[m", "\033[1;32m", "\033[1;31m", "\033[1;33m", "\033[1;36m" };
+
+static bool SpWriteAll(int fd, const void *p, size_t len)
+{
+    const char *pData = (const char *)p;
+    while (len) {
+#ifdef __MINGW32__
+        int ret = _write(fd, pData, len);
+#else
+        ssize_t ret = write(fd, pData, len);
+#endif
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        pData += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+#ifdef __MINGW32__
+/* console colors are set by API, the escapes in the buffer are translated */
+static void SpLogWrite(const char *p, size_t len)
+{
+    HANDLE consolehwnd = GetStdHandle(STD_OUTPUT_HANDLE);
+    const char *pEnd = p+len;
+
+    while (p < pEnd) {
+        const char *pEsc = (const char *)memchr(p, '\033', pEnd-p);
+        SpWriteAll(1, p, (pEsc?pEsc:pEnd)-p);
+        if (!pEsc)
+            break;
+
+        const char *pCode = (const char *)memchr(pEsc, 'm', pEnd-pEsc);
+        if (!pCode)
+            break;
+        unsigned short wColor = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+        switch (pCode[-1]) {
+        case '2': wColor = FOREGROUND_GREEN | FOREGROUND_INTENSITY; break;
+        case '1': wColor = FOREGROUND_RED | FOREGROUND_INTENSITY; break;
+        case '3': wColor = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY; break;
+        case '6': wColor = FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY; break;
+        }
+        SetConsoleTextAttribute(consolehwnd, wColor);
+        p = pCode+1;
+    }
+}
+#else
+static int  sgConsoleFd = STDOUT_FILENO;    /* a dup of stdout while output is captured */
+
+static void SpLogWrite(const char *p, size_t len)
+{
+    SpWriteAll(sgConsoleFd, p, len);
+}
+#endif
+
+/* stdio is flushed first, so text printed by printf keeps its order */
+static void SpLogFlush(SpLogBuf &tLog)
+{
+    if (!tLog.tData.size())
+        return;
+
+    SpAutoLock tLock(sgConsoleLock);
+    fflush(stdout);
+    SpLogWrite(tLog.tData.data(), tLog.tData.size());
+    tLog.tData.clear();
+}
+
+static bool SpLogHeld(const SpLogBuf &tLog)
+{
+    return tLog.blInCase && (tLog.blHold || sgLogQuiet || sgLogOnlyFailures);
+}
+
+static void SpLogAppend(std::string &tData, ColorType Color, const char *pStr, size_t len)
+{
+    if (sgLogColor && Color != ColorType_White)
+        tData += sgColorCode[Color];
+    tData.append(pStr, len);
+    if (sgLogColor)
+        tData += sgColorCode[ColorType_White];
+}
+
+static void SpLogCaseBegin()
+{
+    if (!sgLogBuf)
+        return;
+    SpLogFlush(*sgLogBuf);
+    sgLogBuf->blInCase = true;
+}
+
+/* write the output of a case unless it's not welcome */
+static void SpLogCaseEnd(bool blFailed)
+{
+    if (!sgLogBuf)
+        return;
+    if (sgLogQuiet || (sgLogOnlyFailures && !blFailed))
+        sgLogBuf->tData.clear();
+    sgLogBuf->blInCase = false;
+    SpLogFlush(*sgLogBuf);
+}
+
+/* write what the buffer holds unless the case is held */
+static void SpLogSync()
+{
+    if (sgLogBuf && !SpLogHeld(*sgLogBuf))
+        SpLogFlush(*sgLogBuf);
+}
+
+void SpSetConsoleColor(ColorType t)
+{
+    if (!sgLogColor)
+        return;
+
+    if (sgLogBuf) {
+        sgLogBuf->tData += sgColorCode[t];
+    } else {
+        SpAutoLock tLock(sgConsoleLock);
+        fflush(stdout);
+        SpLogWrite(sgColorCode[t], strlen(sgColorCode[t]));
+    }
+}
+
+void SpUnitPrintf(ColorType Color, const char *pFormat, ...)
+{
+    SpAllocPause tPause;
+    char    abBuf[1024];
+    char    *pBuf = abBuf;
+    int     iLen;
+
+    __builtin_va_list __local_argv, __copy_argv;
+    __builtin_va_start( __local_argv, pFormat );
+    __builtin_va_copy( __copy_argv, __local_argv );
+    iLen = vsnprintf( abBuf, sizeof(abBuf), pFormat, __local_argv );
+    if (iLen >= (int)sizeof(abBuf)) {
+        pBuf = (char *)malloc(iLen+1);
+        if (pBuf)
+            vsnprintf( pBuf, iLen+1, pFormat, __copy_argv );
+    }
+    __builtin_va_end( __copy_argv );
+    __builtin_va_end( __local_argv );
+
+    if (iLen < 0 || !pBuf)
+        return;
+
+    if (sgLogBuf) {
+        SpLogAppend(sgLogBuf->tData, Color, pBuf, iLen);
+        if (!SpLogHeld(*sgLogBuf) && (sgLogTty || sgLogBuf->tData.size() >= SpLogBlock))
+            SpLogFlush(*sgLogBuf);
+    } else {
+        SpLogBuf tLog(false);
+        SpLogAppend(tLog.tData, Color, pBuf, iLen);
+        SpLogFlush(tLog);
+    }
+
+    if (pBuf != abBuf)
+        free(pBuf);
+}
+
+static void SpLogFlushMain()
+{
+    SpLogFlush(sgMainLog);
+}
+
+/* called by SpUnitInit on main thread */
+static void SpLogInit(const std::string &tColor)
+{
+#ifdef __MINGW32__
+    sgLogTty = _isatty(1);
+#else
+    sgLogTty = isatty(STDOUT_FILENO);
+#endif
+    sgLogColor = (tColor == "yes") || (tColor == "auto" && sgLogTty);
+    sgLogBuf = &sgMainLog;
+    atexit(SpLogFlushMain);
+}
+
+/******************************************************************************
+    Output capture, --capture-output. While cases run, fd 1 and 2 are pipe to
+    a reader thread, which keeps what a case writes in the output of the case
+    (at most sgCaptureLimit bytes) and passes what is written between cases to
+    console. Console output of SparrowUnit goes to a dup of the old stdout.
+    The fds are shared by the whole process, so it's for a serial run only.
+******************************************************************************/
+static bool     sgCaptureEnabled = false;
+static size_t   sgCaptureLimit = 1<<20;
+
+#ifndef __MINGW32__
+struct SpCapture {
+    SpMutex     tLock;
+    bool        blRunning;
+    int         readFd;
+    int         wakeFd[2];      /* stops the reader */
+    int         savedFd[2];     /* stdout and stderr before capture */
+    pthread_t   tid;
+    std::string *pOut;          /* output of the running case, NULL between cases */
+    size_t      dropped;
+};
+
+static SpCapture sgCapture;
+
+/* Read all the pipe holds, called with the lock held. false at end of file */
+static bool SpCaptureDrain()
+{
+    char abBuf[65536];
+
+    for (;;) {
+        ssize_t len = read(sgCapture.readFd, abBuf, sizeof(abBuf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return len < 0;
+
+        if (!sgCapture.pOut) {
+            SpWriteAll(sgCapture.savedFd[0], abBuf, len);
+            continue;
+        }
+        size_t room = sgCaptureLimit - std::min(sgCaptureLimit, sgCapture.pOut->size());
+        size_t keep = std::min(room, (size_t)len);
+        sgCapture.pOut->append(abBuf, keep);
+        sgCapture.dropped += len - keep;
+    }
+}
+
+static void *SpCaptureReader(void *)
+{
+    struct pollfd aPoll[2] = { { sgCapture.readFd, POLLIN, 0 }, { sgCapture.wakeFd[0], POLLIN, 0 } };
+
+    for (;;) {
+        if (poll(aPoll, 2, -1) < 0)
+            continue;
+        if (aPoll[1].revents)
+            break;
+
+        SpAutoLock tLock(sgCapture.tLock);
+        if (!SpCaptureDrain())
+            break;
+    }
+    return NULL;
+}
+
+static void SpCaptureRestore()
+{
+    fflush(stdout);
+    fflush(stderr);
+    dup2(sgCapture.savedFd[0], STDOUT_FILENO);
+    dup2(sgCapture.savedFd[1], STDERR_FILENO);
+    sgConsoleFd = STDOUT_FILENO;
+}
+
+static void SpCaptureClose()
+{
+    close(sgCapture.readFd);
+    close(sgCapture.savedFd[0]);
+    close(sgCapture.savedFd[1]);
+    close(sgCapture.wakeFd[0]);
+    close(sgCapture.wakeFd[1]);
+}
+
+/* called by the thread that runs the cases, each process captures its own */
+static void SpCaptureStart()
+{
+    int fd[2];
+
+    if (!sgCaptureEnabled || sgCapture.blRunning)
+        return;
+    if (pipe(fd))
+        return;
+    if (pipe(sgCapture.wakeFd)) {
+        close(fd[0]);
+        close(fd[1]);
+        return;
+    }
+
+    SpLogSync();
+    fflush(stdout);
+    fflush(stderr);
+    sgCapture.savedFd[0] = dup(STDOUT_FILENO);
+    sgCapture.savedFd[1] = dup(STDERR_FILENO);
+    sgCapture.readFd = fd[0];
+    sgCapture.pOut = NULL;
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+    dup2(fd[1], STDOUT_FILENO);
+    dup2(fd[1], STDERR_FILENO);
+    close(fd[1]);
+    sgConsoleFd = sgCapture.savedFd[0];
+
+    if (pthread_create(&sgCapture.tid, NULL, SpCaptureReader, NULL)) {
+        SpCaptureRestore();
+        SpCaptureClose();
+        _SpWarnLog("Start output capture failed, output of cases is not captured.\n");
+        return;
+    }
+    sgCapture.blRunning = true;
+}
+
+static void SpCaptureStop()
+{
+    if (!sgCapture.blRunning)
+        return;
+
+    SpCaptureRestore();
+    SpWriteAll(sgCapture.wakeFd[1], "", 1);
+    pthread_join(sgCapture.tid, NULL);
+    {
+        SpAutoLock tLock(sgCapture.tLock);
+        SpCaptureDrain();
+    }
+    SpCaptureClose();
+    sgCapture.blRunning = false;
+}
+
+/* what was written before the case goes to console */
+static void SpCaptureBegin(std::string *pOut)
+{
+    if (!sgCapture.blRunning)
+        return;
+
+    fflush(stdout);
+    fflush(stderr);
+    SpAutoLock tLock(sgCapture.tLock);
+    SpCaptureDrain();
+    sgCapture.pOut = pOut;
+    sgCapture.dropped = 0;
+}
+
+/* the pipe is read empty, so all the case wrote is in its output */
+static void SpCaptureEnd()
+{
+    if (!sgCapture.blRunning)
+        return;
+
+    fflush(stdout);
+    fflush(stderr);
+    SpAutoLock tLock(sgCapture.tLock);
+    SpCaptureDrain();
+    if (sgCapture.dropped)
+        sgCapture.pOut->append("\nOutput over " + long2String(sgCaptureLimit) + " bytes, " +
+                               long2String(sgCapture.dropped) + " bytes dropped.\n");
+    sgCapture.pOut = NULL;
+}
+#else
+static void SpCaptureStart() {}
+static void SpCaptureStop() {}
+static void SpCaptureBegin(std::string *) {}
+static void SpCaptureEnd() {}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/******************************************************************************
+    Mocker interface
+******************************************************************************/
+#define _SpMockRetAlways        -1
+#define _SpMockMaxArgs          8
+
+static SpMockImp *SpGetMockImp(void *pFunc);
+static void *SpMockStubCreate(SpMockImp *pImp);
+
+/* x86 jumps written to the entry of a mocked function */
+#define _SpJmpRelLen            5       /* E9, rel32 */
+#define _SpJmpAbsLen            14      /* FF 25 00000000, 64 bit address */
+#define _SpIslandSize           16
+#define _SpIslandArenaSize      (64*1024)
+
+/******************************************************************************
+    Code patching. A mocked function gets a 5 byte rel32 jump to its stub;
+    on x86-64 a stub more than 2GB away is reached through a jump island, a
+    14 byte absolute jump put within 2GB of the function. Only if no island
+    can be placed, the 14 byte absolute jump is written to the function.
+******************************************************************************/
+static bool     sgMockWX = false;       /* --mock-wx, no page writable and executable at once */
+
+static size_t SpPageSize()
+{
+#ifdef __MINGW32__
+    SYSTEM_INFO tInfo;
+    GetSystemInfo(&tInfo);
+    return tInfo.dwPageSize;
+#else
+    return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static char *SpPageOf(const void *p)    { return (char *)((size_t)p & ~(SpPageSize()-1)); }
+static char *SpPageEnd(const void *p)   { return SpPageOf((const char *)p + SpPageSize()-1); }
+
+/******************************************************************************
+    W^X code, --mock-wx (Linux only). Code SparrowUnit writes is mapped twice
+    from a memfd, read+exec where it runs and read+write at another address
+    where it is written. Stub and island arenas are allocated so; a page of
+    a mocked function is copied to a memfd and mapped over itself the first
+    time it is patched, later patches of the page need no system call.
+******************************************************************************/
+struct SpAlias {
+    char    *pExec;
+    char    *pWrite;
+    size_t  size;
+};
+
+static SpMutex              sgAliasLock;
+static std::vector<SpAlias> sgAliases;
+
+/* Writable address of code at p, NULL if p has no alias */
+static char *SpAliasOf(const void *p)
+{
+    SpAutoLock tLock(sgAliasLock);
+    for (size_t i=0; i<sgAliases.size(); i++)
+        if ((const char *)p >= sgAliases[i].pExec && (const char *)p < sgAliases[i].pExec+sgAliases[i].size)
+            return sgAliases[i].pWrite + ((const char *)p - sgAliases[i].pExec);
+    return NULL;
+}
+
+/* Address code at p is written at */
+static char *SpCodeMem(void *p)
+{
+    char *pWrite = sgMockWX ? SpAliasOf(p) : NULL;
+    return pWrite ? pWrite : (char *)p;
+}
+
+#ifdef __linux__
+/* Map size bytes of a new memfd read+exec at pExec, exactly if blFixed, and
+   read+write anywhere. pInit is copied to it if not NULL. */
+static void *SpAliasMap(void *pExec, size_t size, bool blFixed, const void *pInit)
+{
+    int fd = syscall(SYS_memfd_create, "SpUnitCode", 0);
+    if (fd < 0) {
+        perror("Errno memfd_create");
+        return NULL;
+    }
+
+    void *pWrite = MAP_FAILED, *p = MAP_FAILED;
+    if (!ftruncate(fd, size))
+        pWrite = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (pWrite != MAP_FAILED) {
+        if (pInit)
+            memcpy(pWrite, pInit, size);
+        p = mmap(pExec, size, PROT_READ|PROT_EXEC, MAP_SHARED|(blFixed?MAP_FIXED:0), fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("Errno mmap code alias");
+        if (pWrite != MAP_FAILED)
+            munmap(pWrite, size);
+        return NULL;
+    }
+
+    SpAlias tAlias = { (char *)p, (char *)pWrite, size };
+    SpAutoLock tLock(sgAliasLock);
+    sgAliases.push_back(tAlias);
+    return p;
+}
+
+static void SpAliasUnmap(void *pExec)
+{
+    SpAutoLock tLock(sgAliasLock);
+    for (size_t i=0; i<sgAliases.size(); i++) {
+        if (sgAliases[i].pExec == pExec) {
+            munmap(sgAliases[i].pWrite, sgAliases[i].size);
+            sgAliases.erase(sgAliases.begin()+i);
+            return;
+        }
+    }
+}
+#endif
+
+/******************************************************************************
+    Patch batch. Code writes made while a batch is open on the thread are
+    kept, and applied when the batch is committed: the last write of an
+    address wins, writes that change nothing are dropped, and every run of
+    adjacent pages gets one protection change (with --mock-wx, is written
+    through its alias). A write without an open batch is a batch of its own.
+******************************************************************************/
+struct SpPatch {
+    unsigned char   abCode[_SpJmpAbsLen];
+    int             len;
+};
+
+typedef std::map<char*, SpPatch>    SpPatchMap;
+
+class SpPatchBatch {
+public:
+    void    add(void *pDst, const void *pSrc, int len);
+    bool    commit();
+
+private:
+    static bool writeRun(char *pStart, char *pEnd, SpPatchMap::iterator first, SpPatchMap::iterator last);
+    SpPatchMap  tPatches;
+};
+
+static SpMutex                  sgPatchLock;    /* pages of two batches may be the same */
+static __thread SpPatchBatch    *sgPatchBatch = NULL;
+static __thread int             sgPatchDepth = 0;
+
+void SpPatchBatch::add(void *pDst, const void *pSrc, int len)
+{
+    SpPatch &tPatch = tPatches[(char *)pDst];
+    memcpy(tPatch.abCode, pSrc, len);
+    tPatch.len = len;
+}
+
+bool SpPatchBatch::commit()
+{
+    SpAutoLock tLock(sgPatchLock);
+    bool blOk = true;
+    SpPatchMap::iterator it = tPatches.begin();
+
+    while (it != tPatches.end()) {
+        char *pStart = SpPageOf(it->first);
+        char *pEnd = SpPageEnd(it->first + it->second.len);
+        SpPatchMap::iterator last = it;
+        for (++last; last!=tPatches.end() && SpPageOf(last->first)<=pEnd; ++last)
+            pEnd = std::max(pEnd, SpPageEnd(last->first + last->second.len));
+
+        blOk = writeRun(pStart, pEnd, it, last) && blOk;
+        it = last;
+    }
+    tPatches.clear();
+    return blOk;
+}
+
+/* Store code with one atomic write if it is in an aligned 8 bytes, a thread
+   running into it sees the old or the new jump, not a mix */
+static void SpCodeStore(char *p, const unsigned char *pSrc, int len)
+{
+    size_t off = (size_t)p & 7;
+    if (off+len > 8) {
+        memcpy(p, pSrc, len);
+        return;
+    }
+
+    volatile unsigned long long *pWord = (volatile unsigned long long *)(p-off);
+    unsigned long long old, val;
+    do {
+        old = *pWord;
+        val = old;
+        memcpy((char *)&val+off, pSrc, len);
+    } while (!__sync_bool_compare_and_swap(pWord, old, val));
+}
+
+/* Write the patches of [first, last), all in pages [pStart, pEnd) */
+bool SpPatchBatch::writeRun(char *pStart, char *pEnd, SpPatchMap::iterator first, SpPatchMap::iterator last)
+{
+    SpPatchMap::iterator it;
+    for (it=first; it!=last; ++it)
+        if (memcmp(it->first, it->second.abCode, it->second.len))
+            break;
+    if (it == last)
+        return true;
+
+#ifdef __linux__
+    if (sgMockWX) {
+        size_t page = SpPageSize();
+        for (char *p=pStart; p<pEnd; p+=page)
+            if (!SpAliasOf(p) && !SpAliasMap(p, page, true, p))
+                return false;
+        for (it=first; it!=last; ++it) {
+            /* a patch may cross into the next page, which has its own alias */
+            for (int i=0; i<it->second.len; ) {
+                char *p = it->first + i;
+                int n = std::min(it->second.len-i, (int)(SpPageEnd(p+1)-p));
+                SpCodeStore(SpAliasOf(p), it->second.abCode+i, n);
+                i += n;
+            }
+        }
+        return true;
+    }
+#endif
+
+#ifdef __MINGW32__
+    DWORD oldProtect, tmp;
+    if (!VirtualProtect(pStart, pEnd-pStart, PAGE_EXECUTE_READWRITE, &oldProtect)) {
+        _SpErrorLog("VirtualProtect %p failed, error %lu.\n", pStart, GetLastError());
+        return false;
+    }
+    for (it=first; it!=last; ++it)
+        SpCodeStore(it->first, it->second.abCode, it->second.len);
+    VirtualProtect(pStart, pEnd-pStart, oldProtect, &tmp);
+    FlushInstructionCache(GetCurrentProcess(), pStart, pEnd-pStart);
+#else
+    if (mprotect(pStart, pEnd-pStart, PROT_READ|PROT_WRITE|PROT_EXEC)) {
+        perror("Errno mprotect");
+        return false;
+    }
+    for (it=first; it!=last; ++it)
+        SpCodeStore(it->first, it->second.abCode, it->second.len);
+    mprotect(pStart, pEnd-pStart, PROT_READ|PROT_EXEC);
+#endif
+    return true;
+}
+
+SpMockBatch::SpMockBatch()
+{
+    SpAllocPause tPause;
+    if (!sgPatchDepth++)
+        sgPatchBatch = new SpPatchBatch;
+}
+
+SpMockBatch::~SpMockBatch()
+{
+    SpAllocPause tPause;
+    if (--sgPatchDepth)
+        return;
+    SpPatchBatch *pBatch = sgPatchBatch;
+    sgPatchBatch = NULL;
+    pBatch->commit();
+    delete pBatch;
+}
+
+/* Write len bytes of code at pDst, now or when the open batch is committed */
+static bool SpCodeWrite(void *pDst, const void *pSrc, int len)
+{
+    if (sgPatchBatch) {
+        sgPatchBatch->add(pDst, pSrc, len);
+        return true;
+    }
+
+    SpPatchBatch tBatch;
+    tBatch.add(pDst, pSrc, len);
+    return tBatch.commit();
+}
+
+/* a rel32 jump at pFrom reaches pTo */
+static bool SpJmpReach(const void *pFrom, const void *pTo)
+{
+#ifdef __x86_64__
+    long long dist = (long long)(size_t)pTo - (long long)((size_t)pFrom + _SpJmpRelLen);
+    return dist >= -0x80000000LL && dist <= 0x7FFFFFFFLL;
+#else
+    (void)pFrom;
+    (void)pTo;
+    return true;        /* rel32 wraps around the whole 32 bit address space */
+#endif
+}
+
+static void SpJmpRel(unsigned char *pCode, const void *pFrom, const void *pTo)
+{
+    int rel = (int)((size_t)pTo - ((size_t)pFrom + _SpJmpRelLen));
+    pCode[0] = 0xE9;
+    memcpy(pCode+1, &rel, sizeof(rel));
+}
+
+static void SpJmpAbs(unsigned char *pCode, const void *pTo)
+{
+    unsigned long long addr = (size_t)pTo;
+    static const unsigned char abJmp[6] = { 0xFF, 0x25, 0, 0, 0, 0 };   /* jmp [rip+0] */
+    memcpy(pCode, abJmp, sizeof(abJmp));
+    memcpy(pCode+sizeof(abJmp), &addr, sizeof(addr));
+}
+
+/* Executable memory at pHint if the system allows, else anywhere */
+static void *SpExecAllocAt(void *pHint, size_t size)
+{
+#ifdef __linux__
+    if (sgMockWX)
+        return SpAliasMap(pHint, size, false, NULL);
+#endif
+#ifdef __MINGW32__
+    void *p = VirtualAlloc(pHint, size, MEM_COMMIT|MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+    return (p || !pHint) ? p : VirtualAlloc(NULL, size, MEM_COMMIT|MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    void *p = mmap(pHint, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    return p==MAP_FAILED ? NULL : p;
+#endif
+}
+
+static void SpExecFree(void *p, size_t size)
+{
+#ifdef __MINGW32__
+    (void)size;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+#ifdef __linux__
+    SpAliasUnmap(p);
+#endif
+    munmap(p, size);
+#endif
+}
+
+/* Executable memory a rel32 jump from pNear can reach, NULL if none is free.
+   Tries free addresses around pNear, nearest first, 64MB apart. */
+static void *SpExecAllocNear(void *pNear, size_t size)
+{
+    const long long step = 64LL<<20;
+    const long long granule = 1<<16;    /* allocation granularity of Windows */
+
+    for (long long dist=0; dist<0x7FFFFFFFLL-step; dist+=step) {
+        for (int dir=-1; dir<=1; dir+=2) {
+            long long addr = ((long long)(size_t)pNear + dir*dist) & ~(granule-1);
+            if (addr <= 0 || (dist==0 && dir>0))
+                continue;
+
+            void *p = SpExecAllocAt((void *)(size_t)addr, size);
+            if (!p)
+                continue;
+            if (SpJmpReach(pNear, p) && SpJmpReach(pNear, (char *)p+size))
+                return p;
+            SpExecFree(p, size);
+        }
+    }
+    return NULL;
+}
+
+/* An absolute jump to pTo that a rel32 jump from pFrom can reach */
+static void *SpIslandCreate(void *pFrom, void *pTo)
+{
+    static SpMutex                          sLock;
+    static std::vector<std::pair<char*, size_t> > sArenas;     /* arena, bytes used */
+    SpAutoLock tLock(sLock);
+    char *pIsland = NULL;
+
+    for (size_t i=0; i<sArenas.size() && !pIsland; i++) {
+        char *p = sArenas[i].first + sArenas[i].second;
+        if (sArenas[i].second+_SpIslandSize <= _SpIslandArenaSize && SpJmpReach(pFrom, p)) {
+            pIsland = p;
+            sArenas[i].second += _SpIslandSize;
+        }
+    }
+    if (!pIsland) {
+        char *pArena = (char *)SpExecAllocNear(pFrom, _SpIslandArenaSize);
+        if (!pArena)
+            return NULL;
+        sArenas.push_back(std::make_pair(pArena, (size_t)_SpIslandSize));
+        pIsland = pArena;
+    }
+
+    SpJmpAbs((unsigned char *)SpCodeMem(pIsland), pTo);
+    return pIsland;
+}
+
+/******************************************************************************
+    Mocker implement. What a mocked function returns and the arguments it
+    replaces are an SpMockScript, built by the SPMOCKER statement and
+    published when the statement ends; it is not changed after that, so
+    callers on any thread read it without lock and take return values by an
+    atomic cursor. The caller that takes the last value asks for unhook, the
+    last caller leaving the stub does it. A replaced script is freed once no
+    caller is in the stub.
+
+    Return values are kept run-length encoded: a segment returns count
+    values start, start+step, ..., so retTimes(v, n) is one segment whatever
+    n is. A call finds its segment from a shared hint, which only moves on.
+******************************************************************************/
+struct SpRetSeg {
+    int         start;
+    int         step;           /* 0 for retTimes */
+    long long   first;          /* index of the first call of the segment */
+    long long   count;
+};
+
+struct SpMockScript {
+    SpMockScript() : blAlwaysRet(false), retValue(0), total(0), cursor(0), segHint(0)
+    {
+        memset(apArgRepVal, 0, sizeof(apArgRepVal));
+        memset(adwArgLen, 0, sizeof(adwArgLen));
+    }
+
+    bool        blAlwaysRet;
+    int         retValue;
+    std::vector<SpRetSeg>   tRetDB;
+    long long           total;          /* values of all segments */
+    volatile long long  cursor;         /* index of the next call */
+    volatile long       segHint;        /* segment of a recent call */
+    void*       apArgRepVal[_SpMockMaxArgs];
+    int         adwArgLen[_SpMockMaxArgs];
+};
+
+class SpMockImp {
+public:
+    SpMockImp(void *pFunc);
+
+    int     call(void *p0, void *p1, void *p2, void *p3, void *p4, void *p5, void *p6, void *p7);
+
+    bool    init() { pStub = SpMockStubCreate(this); return pStub != NULL; }
+    void    begin();
+    void    commit();
+    void    reset();
+    void    addRet(int start, int step, long long count);
+    bool    repArg(int no, void *prep, int len);
+
+private:
+    int     getRet(SpMockScript *pScript);
+    void    publish(SpMockScript *pNew);
+    void    unhookDone();
+    bool    hookApi(void* ApiFun, void* HookFun);
+    bool    unhookApi(void* ApiFun);
+
+private:
+    SpMutex     tLock;          /* of SPMOCKER statements and unhook, not of callers */
+    void*       pFunc;          /* the mocked function */
+    void*       pStub;          /* generated stub, calls SpMockCall with this */
+    void*       pHookFunc;      /* pFunc while it is hooked, else NULL */
+
+    SpMockScript* volatile  pScript;    /* read by callers */
+    volatile long           unhookAsked;    /* a script was used up */
+    volatile long           inFlight;   /* callers in the stub */
+    SpMockScript*           pBuild;     /* script of the running SPMOCKER statement */
+    std::vector<SpMockScript*>  tRetired;   /* replaced, freed when inFlight is 0 */
+
+    void*       pIsland;        /* jump island to pStub, if pStub is out of reach */
+    unsigned char   ApiBackup[_SpJmpAbsLen];    /* code backup */
+    int         backupLen;
+    bool        blBackup;       /* ApiBackup holds the original code */
+};
+
+SpMockImp::SpMockImp(void *pFunc) : pFunc(pFunc), pStub(NULL), pHookFunc(NULL), pScript(NULL), unhookAsked(0),
+                                    inFlight(0), pBuild(NULL), pIsland(NULL), backupLen(0), blBackup(false) {}
+
+/* Replace the script callers read, free the replaced ones nobody can read.
+   tLock is held. */
+void SpMockImp::publish(SpMockScript *pNew)
+{
+    SpMockScript *pOld = __sync_lock_test_and_set(&pScript, pNew);
+    if (pOld)
+        tRetired.push_back(pOld);
+
+    /* a caller reads pScript after it counts itself in, none is in now */
+    if (__sync_add_and_fetch(&inFlight, 0) == 0) {
+        for (size_t i=0; i<tRetired.size(); i++)
+            delete tRetired[i];
+        tRetired.clear();
+    }
+}
+
+/* Start an SPMOCKER statement, the function stays as it is meanwhile */
+void SpMockImp::begin()
+{
+    SpAutoLock tAutoLock(tLock);
+    delete pBuild;
+    pBuild = new SpMockScript;
+}
+
+/* End an SPMOCKER statement, callers get the new script from now on */
+void SpMockImp::commit()
+{
+    SpAutoLock tAutoLock(tLock);
+    if (!pBuild)
+        return;
+
+    publish(pBuild);
+    pBuild = NULL;
+    if (!pHookFunc) {
+        pHookFunc = pFunc;
+        SpTraceInstant("mock hook", "mock", pHookFunc);
+        hookApi(pHookFunc, pStub);
+    }
+}
+
+void SpMockImp::reset()
+{
+    SpAutoLock tAutoLock(tLock);
+    if (pHookFunc) {
+        SpTraceInstant("mock unhook", "mock", pHookFunc);
+        unhookApi(pHookFunc);
+    }
+
+    pHookFunc = NULL;
+    publish(NULL);
+}
+
+/* The last caller left after a script was used up, unhook if the current
+   one is, SPMOCKER may have given a new script meanwhile */
+void SpMockImp::unhookDone()
+{
+    SpAllocPause tPause;
+    SpAutoLock tAutoLock(tLock);
+    SpMockScript *p = pScript;
+
+    if (!__sync_lock_test_and_set(&unhookAsked, 0))
+        return;
+    if (p && !p->blAlwaysRet && p->cursor >= std::max(p->total, 1LL)) {
+        if (pHookFunc) {
+            SpTraceInstant("mock unhook", "mock", pHookFunc);
+            unhookApi(pHookFunc);
+        }
+        pHookFunc = NULL;
+        publish(NULL);
+    }
+}
+
+int SpMockImp::call(void *p0, void *p1, void *p2, void *p3, void *p4, void *p5, void *p6, void *p7)
+{
+    int ret = -1;
+
+    __sync_fetch_and_add(&inFlight, 1);
+    SpMockScript *p = pScript;
+    if (p) {
+        #define _SpFSetArg(No)  if (p->adwArgLen[No])   memcpy(p##No, p->apArgRepVal[No], p->adwArgLen[No])
+
+        _SpFSetArg(0);  _SpFSetArg(1);  _SpFSetArg(2);  _SpFSetArg(3);
+        _SpFSetArg(4);  _SpFSetArg(5);  _SpFSetArg(6);  _SpFSetArg(7);
+        ret = getRet(p);
+    }
+    if (__sync_sub_and_fetch(&inFlight, 1) == 0 && unhookAsked)
+        unhookDone();
+    return ret;
+}
+
+int SpMockImp::getRet(SpMockScript *p)
+{
+    if (p->blAlwaysRet)
+        return p->retValue;
+
+    long long idx = __sync_fetch_and_add(&p->cursor, 1);
+    /* one caller takes the last value, or finds there is none */
+    if (idx == (p->total ? p->total-1 : 0))
+        __sync_lock_test_and_set(&unhookAsked, 1);
+    if (idx >= p->total)
+        return -1;
+
+    /* callers take increasing indexes, the hint is at most a few segments
+       away from the one of idx */
+    long hint = p->segHint, seg = hint;
+    while (idx >= p->tRetDB[seg].first + p->tRetDB[seg].count)
+        seg++;
+    while (idx < p->tRetDB[seg].first)
+        seg--;
+    if (seg > hint)
+        __sync_bool_compare_and_swap(&p->segHint, hint, seg);
+
+    const SpRetSeg &tSeg = p->tRetDB[seg];
+    return (int)(tSeg.start + (idx - tSeg.first) * tSeg.step);
+}
+
+bool SpMockImp::repArg(int no, void *prep, int len)
+{
+    if (no>=_SpMockMaxArgs || !pBuild)
+        return false;
+    pBuild->apArgRepVal[no] = prep;
+    pBuild->adwArgLen[no] = len;
+    return true;
+}
+
+void SpMockImp::addRet(int start, int step, long long count)
+{
+    if (!pBuild)
+        return;
+    if (count == _SpMockRetAlways) {
+        pBuild->retValue = start;
+        pBuild->blAlwaysRet = true;
+        return;
+    }
+    if (count <= 0)
+        return;
+
+    /* values the last segment goes on with join it, retOnce in a loop
+       keeps one segment. The next value of a stepped segment is computed
+       in long long, a single value joins only if it is exactly that one,
+       so every value of the grown segment is still an int. */
+    std::vector<SpRetSeg> &tSegs = pBuild->tRetDB;
+    if (tSegs.size()) {
+        SpRetSeg &tLast = tSegs.back();
+        long long next = tLast.start + tLast.count*tLast.step;
+        bool blSame = !step && !tLast.step && start == tLast.start;
+        bool blNext = count == 1 && tLast.step && next == start;
+        if (blSame || blNext) {
+            tLast.count += count;
+            pBuild->total += count;
+            return;
+        }
+    }
+
+    SpRetSeg tSeg = { start, step, pBuild->total, count };
+    tSegs.push_back(tSeg);
+    pBuild->total += count;
+}
+
+/* Jump from the entry of ApiFun to HookFun, directly or through an island */
+bool SpMockImp::hookApi(void* ApiFun, void* HookFun)
+{
+    unsigned char abJmp[_SpJmpAbsLen];
+
+    if (!SpJmpReach(ApiFun, HookFun) && !pIsland)
+        pIsland = SpIslandCreate(ApiFun, HookFun);
+
+    if (SpJmpReach(ApiFun, HookFun)) {
+        backupLen = _SpJmpRelLen;
+        SpJmpRel(abJmp, ApiFun, HookFun);
+    } else if (pIsland) {
+        backupLen = _SpJmpRelLen;
+        SpJmpRel(abJmp, ApiFun, pIsland);
+    } else {
+        /* overwrites 14 bytes, the function must not be shorter */
+        _SpWarnLog("No jump island near %p, patch it with a 14 bytes absolute jump.\n", ApiFun);
+        backupLen = _SpJmpAbsLen;
+        SpJmpAbs(abJmp, HookFun);
+    }
+
+    /* the entry keeps the jump while the function is mocked again */
+    if (!blBackup) {
+        memcpy(ApiBackup, ApiFun, backupLen);
+        blBackup = true;
+    }
+    return SpCodeWrite(ApiFun, abJmp, backupLen);
+}
+
+bool SpMockImp::unhookApi(void* ApiFun)
+{
+    return SpCodeWrite(ApiFun, ApiBackup, backupLen);
+}
+
+/******************************************************************************
+    Mocker user interface
+******************************************************************************/
+SpMock::SpMock(void *pFunc, bool reset) : blReset(reset)
+{
+    SpAllocPause tPause;
+    pImp = SpGetMockImp(pFunc);
+    if (!pImp)
+        throw 1000;
+    if (reset)
+        pImp->reset();
+    else
+        pImp->begin();
+}
+
+/* End of the SPMOCKER statement, the whole script is set */
+SpMock::~SpMock()
+{
+    SpAllocPause tPause;
+    if (!blReset)
+        pImp->commit();
+}
+
+SpMock &SpMock::retAlways(int value)
+{
+    SpAllocPause tPause;
+    pImp->addRet(value, 0, _SpMockRetAlways);
+    return *this;
+}
+
+SpMock &SpMock::retOnce(int value)
+{
+    SpAllocPause tPause;
+    pImp->addRet(value, 0, 1);
+    return *this;
+}
+
+SpMock &SpMock::retTimes(int value, int times)
+{
+    SpAllocPause tPause;
+    pImp->addRet(value, 0, times);
+    return *this;
+}
+
+/* valStart, valStart+step, ... while not past valEnd */
+SpMock &SpMock::retRange(int valStart, int valEnd, int step)
+{
+    SpAllocPause tPause;
+    if (step && ((long long)valEnd-valStart)*step >= 0)
+        pImp->addRet(valStart, step, ((long long)valEnd-valStart)/step + 1);
+    return *this;
+}
+
+SpMock &SpMock::repArg(int no, void *prep, int len)
+{
+    SpAllocPause tPause;
+    pImp->repArg(no, prep, len);
+    return *this;
+}
+
+/******************************************************************************
+    Mocker stubs, generated at run time into an executable arena, one for each
+    mocked function. A stub calls SpMockCall with its SpMockImp and the first
+    _SpMockMaxArgs arguments of the call, and returns what it returns. The
+    stack is aligned again, gcc may call a function of the same file that
+    needs no alignment with a misaligned stack.
+******************************************************************************/
+static int SpMockCall(SpMockImp *pImp, void *p0, void *p1, void *p2, void *p3,
+                      void *p4, void *p5, void *p6, void *p7)
+{
+    return pImp->call(p0,p1,p2,p3,p4,p5,p6,p7);
+}
+
+#if defined(__x86_64__) && defined(_WIN64)
+/* p0-p3 in rcx, rdx, r8, r9, the rest after 32 bytes of shadow space; the
+   SpMockImp goes first, so p3-p7 are passed on stack */
+static const unsigned char sgStubCode[] = {
+    0x55,                               /* push rbp */
+    0x48, 0x89, 0xE5,                   /* mov  rbp, rsp */
+    0x48, 0x83, 0xE4, 0xF0,             /* and  rsp, -16 */
+    0x48, 0x83, 0xEC, 0x50,             /* sub  rsp, 80 */
+    0x4C, 0x89, 0x4C, 0x24, 0x20,       /* mov  [rsp+32], r9 */
+    0x48, 0x8B, 0x45, 0x30,             /* mov  rax, [rbp+48] */
+    0x48, 0x89, 0x44, 0x24, 0x28,       /* mov  [rsp+40], rax */
+    0x48, 0x8B, 0x45, 0x38,             /* mov  rax, [rbp+56] */
+    0x48, 0x89, 0x44, 0x24, 0x30,       /* mov  [rsp+48], rax */
+    0x48, 0x8B, 0x45, 0x40,             /* mov  rax, [rbp+64] */
+    0x48, 0x89, 0x44, 0x24, 0x38,       /* mov  [rsp+56], rax */
+    0x48, 0x8B, 0x45, 0x48,             /* mov  rax, [rbp+72] */
+    0x48, 0x89, 0x44, 0x24, 0x40,       /* mov  [rsp+64], rax */
+    0x4D, 0x89, 0xC1,                   /* mov  r9, r8 */
+    0x49, 0x89, 0xD0,                   /* mov  r8, rdx */
+    0x48, 0x89, 0xCA,                   /* mov  rdx, rcx */
+    0x48, 0xB9, 0,0,0,0,0,0,0,0,        /* mov  rcx, pImp */
+    0x48, 0xB8, 0,0,0,0,0,0,0,0,        /* mov  rax, SpMockCall */
+    0xFF, 0xD0,                         /* call rax */
+    0xC9,                               /* leave */
+    0xC3,                               /* ret */
+};
+#define _SpStubImpPos       64
+#define _SpStubCallPos      74
+#elif defined(__x86_64__)
+/* p0-p5 in rdi, rsi, rdx, rcx, r8, r9, p6 and p7 on stack; the SpMockImp
+   goes first, so p5-p7 are passed on stack */
+static const unsigned char sgStubCode[] = {
+    0x55,                               /* push rbp */
+    0x48, 0x89, 0xE5,                   /* mov  rbp, rsp */
+    0x48, 0x83, 0xE4, 0xF0,             /* and  rsp, -16 */
+    0x48, 0x83, 0xEC, 0x20,             /* sub  rsp, 32 */
+    0x4C, 0x89, 0x0C, 0x24,             /* mov  [rsp], r9 */
+    0x48, 0x8B, 0x45, 0x10,             /* mov  rax, [rbp+16] */
+    0x48, 0x89, 0x44, 0x24, 0x08,       /* mov  [rsp+8], rax */
+    0x48, 0x8B, 0x45, 0x18,             /* mov  rax, [rbp+24] */
+    0x48, 0x89, 0x44, 0x24, 0x10,       /* mov  [rsp+16], rax */
+    0x4D, 0x89, 0xC1,                   /* mov  r9, r8 */
+    0x49, 0x89, 0xC8,                   /* mov  r8, rcx */
+    0x48, 0x89, 0xD1,                   /* mov  rcx, rdx */
+    0x48, 0x89, 0xF2,                   /* mov  rdx, rsi */
+    0x48, 0x89, 0xFE,                   /* mov  rsi, rdi */
+    0x48, 0xBF, 0,0,0,0,0,0,0,0,        /* mov  rdi, pImp */
+    0x48, 0xB8, 0,0,0,0,0,0,0,0,        /* mov  rax, SpMockCall */
+    0xFF, 0xD0,                         /* call rax */
+    0xC9,                               /* leave */
+    0xC3,                               /* ret */
+};
+#define _SpStubImpPos       51
+#define _SpStubCallPos      61
+#else
+/* cdecl, all arguments on stack: push p7..p0 and the SpMockImp */
+static const unsigned char sgStubCode[] = {
+    0x55,                               /* push ebp */
+    0x89, 0xE5,                         /* mov  ebp, esp */
+    0x83, 0xE4, 0xF0,                   /* and  esp, -16 */
+    0x83, 0xEC, 0x0C,                   /* sub  esp, 12 */
+    0xFF, 0x75, 0x24,                   /* push [ebp+36], p7 */
+    0xFF, 0x75, 0x20,                   /* push [ebp+32], p6 */
+    0xFF, 0x75, 0x1C,                   /* ... */
+    0xFF, 0x75, 0x18,
+    0xFF, 0x75, 0x14,
+    0xFF, 0x75, 0x10,
+    0xFF, 0x75, 0x0C,
+    0xFF, 0x75, 0x08,                   /* push [ebp+8], p0 */
+    0x68, 0,0,0,0,                      /* push pImp */
+    0xB8, 0,0,0,0,                      /* mov  eax, SpMockCall */
+    0xFF, 0xD0,                         /* call eax */
+    0xC9,                               /* leave */
+    0xC3,                               /* ret */
+};
+#define _SpStubImpPos       34
+#define _SpStubCallPos      39
+#endif
+
+#define _SpStubSize         ((sizeof(sgStubCode)+15) & ~15)
+#define _SpArenaSize        (64*1024)
+
+static void *SpMockStubCreate(SpMockImp *pImp)
+{
+    static char     *pArena = NULL;
+    static size_t   arenaLeft = 0;
+    void *pCall = (void *)SpMockCall;
+
+    if (arenaLeft < _SpStubSize) {
+        /* near the code of SparrowUnit, mocked functions are often there too */
+        pArena = (char *)SpExecAllocNear((void *)SpMockCall, _SpArenaSize);
+        if (!pArena)
+            pArena = (char *)SpExecAllocAt(NULL, _SpArenaSize);
+        if (!pArena) {
+            _SpErrorLog("Allocate executable memory for mock stubs failed.\n");
+            arenaLeft = 0;
+            return NULL;
+        }
+        arenaLeft = _SpArenaSize;
+    }
+
+    char *pStub = pArena;
+    char *pCode = SpCodeMem(pStub);
+    memcpy(pCode, sgStubCode, sizeof(sgStubCode));
+    memcpy(pCode+_SpStubImpPos, &pImp, sizeof(pImp));
+    memcpy(pCode+_SpStubCallPos, &pCall, sizeof(pCall));
+    pArena += _SpStubSize;
+    arenaLeft -= _SpStubSize;
+    return pStub;
+}
+
+/******************************************************************************
+    Mocked functions, open addressing hash of function address to its
+    SpMockImp. An SpMockImp and its stub are kept once the function was
+    mocked, so entries are never removed. Mocks are not reset when a case
+    ends, SPMOCKER_RESET finds its function through the hash.
+******************************************************************************/
+class SpMockMap {
+public:
+    SpMockMap() : count(0) {}
+
+    SpMockImp   *find(void *pFunc) const;
+    void        add(void *pFunc, SpMockImp *pImp);
+
+private:
+    size_t      slotOf(void *pFunc) const;
+
+    std::vector<std::pair<void*, SpMockImp*> >  tSlots;     /* size is a power of 2 */
+    size_t      count;
+};
+
+size_t SpMockMap::slotOf(void *pFunc) const
+{
+    size_t mask = tSlots.size()-1;
+    size_t i = (size_t)(((unsigned long long)(size_t)pFunc * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    while (tSlots[i].first && tSlots[i].first != pFunc)
+        i = (i+1) & mask;
+    return i;
+}
+
+SpMockImp *SpMockMap::find(void *pFunc) const
+{
+    return tSlots.size() ? tSlots[slotOf(pFunc)].second : NULL;
+}
+
+void SpMockMap::add(void *pFunc, SpMockImp *pImp)
+{
+    /* at most half full */
+    if ((count+1)*2 > tSlots.size()) {
+        std::vector<std::pair<void*, SpMockImp*> > tOld;
+        tOld.swap(tSlots);
+        tSlots.assign(tOld.size() ? tOld.size()*2 : 64, std::make_pair((void *)NULL, (SpMockImp *)NULL));
+        for (size_t i=0; i<tOld.size(); i++)
+            if (tOld[i].first)
+                tSlots[slotOf(tOld[i].first)] = tOld[i];
+    }
+
+    tSlots[slotOf(pFunc)] = std::make_pair(pFunc, pImp);
+    count++;
+}
+
+static SpMutex      sgMockLock;
+static SpMockMap    sgMockMap;
+
+static SpMockImp *SpGetMockImp(void *pFunc)
+{
+    SpAutoLock tLock(sgMockLock);
+    SpMockImp *pImp = sgMockMap.find(pFunc);
+
+    if (!pImp) {
+        pImp = new SpMockImp(pFunc);
+        if (!pImp->init()) {
+            delete pImp;
+            return NULL;
+        }
+        sgMockMap.add(pFunc, pImp);
+    }
+    return pImp;
+}
+
+/******************************************************************************
+    Gtest filter, POSITIVE[-NEGATIVE], each a ':' separated list of patterns
+    of Suite.Name with '*' and '?'. A case runs if it matches a positive
+    pattern (all cases if there is none) and no negative pattern. Patterns
+    are compiled once: split at '*' into segments, the first segment is
+    matched at the start of the name, the last at the end and the others at
+    their leftmost place, so a name is matched in one pass.
+******************************************************************************/
+class SpGlob {
+public:
+    SpGlob(const std::string &tPattern);
+    bool    match(const char *p, size_t len) const;
+
+private:
+    static bool segEqu(const char *p, const std::string &tSeg);
+    std::vector<std::string> tSegs;     /* more than one if there is a '*' */
+};
+
+SpGlob::SpGlob(const std::string &tPattern)
+{
+    size_t pos = 0, end;
+    while ((end = tPattern.find('*', pos)) != std::string::npos) {
+        tSegs.push_back(tPattern.substr(pos, end-pos));
+        pos = end+1;
+    }
+    tSegs.push_back(tPattern.substr(pos));
+}
+
+bool SpGlob::segEqu(const char *p, const std::string &tSeg)
+{
+    for (size_t i=0; i<tSeg.size(); i++)
+        if (tSeg[i] != p[i] && tSeg[i] != '?')
+            return false;
+    return true;
+}
+
+bool SpGlob::match(const char *p, size_t len) const
+{
+    const std::string &tFirst = tSegs.front();
+    const std::string &tLast = tSegs.back();
+
+    if (tSegs.size() == 1)
+        return len == tFirst.size() && segEqu(p, tFirst);
+    if (len < tFirst.size()+tLast.size() || !segEqu(p, tFirst) || !segEqu(p+len-tLast.size(), tLast))
+        return false;
+
+    size_t pos = tFirst.size(), end = len-tLast.size();
+    for (size_t i=1; i+1<tSegs.size(); i++) {
+        const std::string &tSeg = tSegs[i];
+        while (pos+tSeg.size()<=end && !segEqu(p+pos, tSeg))
+            pos++;
+        if (pos+tSeg.size() > end)
+            return false;
+        pos += tSeg.size();
+    }
+    return true;
+}
+
+class SpFilter {
+public:
+    void    compile(const std::string &tFilter);
+    bool    empty() const { return tPositive.empty() && tNegative.empty(); }
+    bool    match(const SpCaseInfo *p) const;
+
+private:
+    static void addPatterns(std::vector<SpGlob> &tGlobs, const std::string &tList);
+    static bool matchAny(const std::vector<SpGlob> &tGlobs, const std::string &tKey);
+
+    std::vector<SpGlob> tPositive;
+    std::vector<SpGlob> tNegative;
+    mutable std::string tKey;       /* Suite.Name, buffer kept between calls */
+};
+
+void SpFilter::addPatterns(std::vector<SpGlob> &tGlobs, const std::string &tList)
+{
+    std::string tPatterns = tList + ":";
+    size_t pos = 0, end;
+    for (; (end = tPatterns.find(':', pos)) != std::string::npos; pos = end+1)
+        if (end > pos)
+            tGlobs.push_back(SpGlob(tPatterns.substr(pos, end-pos)));
+}
+
+void SpFilter::compile(const std::string &tFilter)
+{
+    size_t sep = tFilter.find('-');
+
+    tPositive.clear();
+    tNegative.clear();
+    addPatterns(tPositive, tFilter.substr(0, sep));
+    if (sep != std::string::npos)
+        addPatterns(tNegative, tFilter.substr(sep+1));
+}
+
+bool SpFilter::matchAny(const std::vector<SpGlob> &tGlobs, const std::string &tKey)
+{
+    for (size_t i=0; i<tGlobs.size(); i++)
+        if (tGlobs[i].match(tKey.data(), tKey.size()))
+            return true;
+    return false;
+}
+
+bool SpFilter::match(const SpCaseInfo *p) const
+{
+    if (empty())
+        return true;
+
+    tKey = p->pSuite;
+    tKey += '.';
+    tKey += p->pName;
+    return (tPositive.empty() || matchAny(tPositive, tKey)) && !matchAny(tNegative, tKey);
+}
+
+bool SpFilterMatch(const char *pFilter, const char *pSuite, const char *pName)
+{
+    SpFilter tFilter;
+    SpCaseInfo tCase = { pSuite, pName, NULL, 0, NULL, NULL };
+    tFilter.compile(pFilter);
+    return tFilter.match(&tCase);
+}
+
+/******************************************************************************
+    Sparrow User interface
+******************************************************************************/
+static bool gArgShowHelp = false;
+static bool gArgShowCaseList = false;
+static std::string  gArgFilter;
+static std::string  gArgGtestFilter;
+static SpFilter     gFilter;
+static std::string  gArgXmlFile;
+static std::string  gArgJsonFile;
+static std::string  gArgBinFile;
+static std::string  gArgMergeFiles;
+static int          gArgJobs = 1;
+static int          gArgTotalShards = 0;
+static int          gArgShardIndex = -1;
+static int          gArgForkShards = 0;
+static std::string  gArgTimingDB;
+static int          gArgBenchTime = 500;
+static std::string  gArgBaseline = "SpUnitBaseline.txt";
+static bool         gArgUpdateBaseline = false;
+static int          gArgTolerance = 10;
+static int          gArgRetries = 3;
+static bool         gArgPerfCounters = false;
+static std::string  gArgTraceFile;
+static int          gArgFailMessages = 10;
+static int          gArgFailInfoLimit = 1<<20;
+static int          gArgFailPrintLimit = 100;
+static int          gArgCaseFailLimit = 0;
+static bool         gArgAssertionReport = false;
+static std::string  gArgColor = "auto";
+static bool         gArgQuiet = false;
+static bool         gArgOnlyFailures = false;
+static bool         gArgCaptureOutput = false;
+static int          gArgCaptureLimit = 1<<20;
+static bool         gArgMockWX = false;
+
+static void SpParseArg(int argc, char **argv)
+{
+#define _SpParseSwitchArg(pStr, arg, set)      {\
+                    if (!strcmp(argv[dwCurArg], (char *)(pStr))) { \
+                        arg = set; \
+                    }}
+#define _SpParseComplxArg(pStr, arg, func)      {\
+                    if (!strncmp(argv[dwCurArg], (char *)(pStr), strlen(pStr))) { \
+                        arg = func(&argv[dwCurArg][strlen(pStr)+1]); \
+                    }}
+
+    int dwCurArg = 1;
+    while(dwCurArg < argc) {
+        _SpParseSwitchArg("--help",                 gArgShowHelp,       true);
+        _SpParseSwitchArg("--gtest_list_tests",     gArgShowCaseList,   true);
+        _SpParseComplxArg("--vague-match",          gArgFilter,         std::string);
+        _SpParseComplxArg("--gtest_filter",         gArgGtestFilter,    std::string);
+        _SpParseComplxArg("--gtest_output=xml",     gArgXmlFile,        std::string);
+        _SpParseComplxArg("--gtest_output=json",    gArgJsonFile,       std::string);
+        _SpParseComplxArg("--gtest_output=bin",     gArgBinFile,        std::string);
+        _SpParseComplxArg("--merge",                gArgMergeFiles,     std::string);
+        _SpParseComplxArg("--jobs",                 gArgJobs,           atoi);
+        _SpParseComplxArg("--gtest_total_shards",   gArgTotalShards,    atoi);
+        _SpParseComplxArg("--gtest_shard_index",    gArgShardIndex,     atoi);
+        _SpParseComplxArg("--fork-shards",          gArgForkShards,     atoi);
+        _SpParseComplxArg("--timing-db",            gArgTimingDB,       std::string);
+        _SpParseComplxArg("--bench-time",           gArgBenchTime,      atoi);
+        _SpParseComplxArg("--baseline",             gArgBaseline,       std::string);
+        _SpParseSwitchArg("--update-baseline",      gArgUpdateBaseline, true);
+        _SpParseComplxArg("--regression-tolerance", gArgTolerance,      atoi);
+        _SpParseComplxArg("--regression-retries",   gArgRetries,        atoi);
+        _SpParseSwitchArg("--perf-counters",        gArgPerfCounters,   true);
+        _SpParseComplxArg("--trace_output",         gArgTraceFile,      std::string);
+        _SpParseComplxArg("--fail-messages",        gArgFailMessages,   atoi);
+        _SpParseComplxArg("--fail-info-limit",      gArgFailInfoLimit,  atoi);
+        _SpParseComplxArg("--fail-print-limit",     gArgFailPrintLimit, atoi);
+        _SpParseComplxArg("--case-fail-limit",      gArgCaseFailLimit,  atoi);
+        _SpParseSwitchArg("--assertion-report",     gArgAssertionReport, true);
+        _SpParseComplxArg("--gtest_color",          gArgColor,          std::string);
+        _SpParseSwitchArg("--quiet",                gArgQuiet,          true);
+        _SpParseSwitchArg("--only-failures",        gArgOnlyFailures,   true);
+        _SpParseSwitchArg("--capture-output",       gArgCaptureOutput,  true);
+        _SpParseComplxArg("--capture-limit",        gArgCaptureLimit,   atoi);
+        _SpParseSwitchArg("--mock-wx",              gArgMockWX,         true);
+        dwCurArg++;
+    }
+
+    /* gtest takes shard setting from environment */
+    if (!gArgTotalShards && getenv("GTEST_TOTAL_SHARDS"))
+        gArgTotalShards = atoi(getenv("GTEST_TOTAL_SHARDS"));
+    if (gArgShardIndex<0 && getenv("GTEST_SHARD_INDEX"))
+        gArgShardIndex = atoi(getenv("GTEST_SHARD_INDEX"));
+    if (gArgGtestFilter.empty() && getenv("GTEST_FILTER"))
+        gArgGtestFilter = getenv("GTEST_FILTER");
+    gFilter.compile(gArgGtestFilter);
+}
+
+static void SpShowHelp()
+{
+    const char    *pUsage =
+    "Help Options:\n"
+    "    --help                     Print this help\n"
+    "    --gtest_list_tests         Show the cases a run with the same flags would run\n"
+    "    --vague-match=FILTER       Run test case that can vague match\n"
+    "    --gtest_filter=FILTER      Run test cases match Suite.Name patterns, * ? : and -NEGATIVE\n"
+    "    --gtest_output=xml:FILE    Write result to xml file\n"
+    "    --gtest_output=json:FILE   Write result to json file\n"
+    "    --gtest_output=bin:FILE    Write result to binary file, read by --merge\n"
+    "    --merge=FILE,FILE...       Run no case, write the results of binary files to one report\n"
+    "    --jobs=N                   Run test cases on N threads\n"
+    "    --gtest_total_shards=N     Split test cases into N shards\n"
+    "    --gtest_shard_index=I      Run the I-th shard only, start from 0\n"
+    "    --fork-shards=N            Run test cases in N child processes\n"
+    "    --timing-db=FILE           Schedule by case time of last run, save time of this run\n"
+    "    --bench-time=MS            Time to measure each benchmark case, default 500ms\n"
+    "    --baseline=FILE            Baseline file of EXPECT_NO_REGRESSION, default SpUnitBaseline.txt\n"
+    "    --update-baseline          Write measured values of this run to baseline file\n"
+    "    --regression-tolerance=P   Allowed regression in percent, default 10\n"
+    "    --regression-retries=N     Measure again N times before report a regression, default 3\n"
+    "    --perf-counters            Count cpu cycles, instructions and misses of each test body\n"
+    "    --trace_output=FILE        Write a Chrome trace event timeline of the run to file\n"
+    "    --fail-messages=N          Full messages kept of each failing assertion, default 10\n"
+    "    --fail-info-limit=BYTES    Failure messages kept of each case, default 1048576\n"
+    "    --fail-print-limit=N       Failure messages printed of each case, default 100\n"
+    "    --case-fail-limit=N        Stop a case after N failed assertions, default 0 never\n"
+    "    --assertion-report         Show assertion sites never run, hottest and failed\n"
+    "    --gtest_color=WHEN         Color the output: yes, no or auto (on a terminal only)\n"
+    "    --quiet                    Print no output of cases, only the summary\n"
+    "    --only-failures            Print output of failed cases only\n"
+    "    --capture-output           Keep stdout and stderr of each case in report, print it for failed cases\n"
+    "    --capture-limit=BYTES      Output kept of each case, default 1048576\n"
+    "    --mock-wx                  Patch mocked code through a second mapping, no page is writable and executable\n"
+    "\n";
+    printf(pUsage);
+}
+/* cases a run selects: --vague-match on the name, --gtest_filter, then the shard */
+static void SpSelectCases(std::vector<SpCaseInfo*> &tCases)
+{
+    int iMatched = 0;
+    for (SpCaseInfo *p=SpCaseDB::first(); p; p=p->pNext) {
+        if ((gArgFilter.size() && !strstr(p->pName, gArgFilter.c_str())) || !gFilter.match(p))
+            continue;
+        if (gArgTotalShards>0 && (iMatched++)%gArgTotalShards != gArgShardIndex)
+            continue;
+        tCases.push_back(p);
+    }
+}
+
+static void SpShowCaseList()
+{
+    std::vector<SpCaseInfo*> tCases;
+    SpSelectCases(tCases);
+    printf("Test case list: \n");
+    for (size_t i=0; i<tCases.size(); i++)
+        printf("    %s.%s\n", tCases[i]->pSuite, tCases[i]->pName);
+}
+
+static bool SpPreprocess()
+{
+#define _SpCheckFlagAndCall(flag, call)   if (flag) {call();return false;}
+
+    _SpCheckFlagAndCall(gArgShowHelp, SpShowHelp);
+
+    if (gArgTotalShards>0 || gArgShardIndex>=0) {
+        if (gArgTotalShards<=0 || gArgShardIndex<0 || gArgShardIndex>=gArgTotalShards) {
+            _SpErrorLog("Invalid shard setting: total %d, index %d.\n", gArgTotalShards, gArgShardIndex);
+            return false;
+        }
+
+        /* tell the caller this binary knows sharding */
+        const char *pStatusFile = getenv("GTEST_SHARD_STATUS_FILE");
+        if (pStatusFile)
+            writeStringToFile(pStatusFile, "");
+    }
+
+    _SpCheckFlagAndCall(gArgShowCaseList, SpShowCaseList);
+    return true;
+}
+
+/******************************************************************************
+    Sparrow benchmark
+******************************************************************************/
+#define _SpBenchSamples         100
+#define _SpBenchMaxBatch        (1LL<<40)
+
+long long SpBench::runBatch(long long iterations)
+{
+    long long tStart = SpGetWallTime();
+    for (long long i=0; i<iterations; i++)
+        BenchBody();
+    return SpGetWallTime() - tStart;
+}
+
+/* Find a batch size that runs 1/_SpBenchSamples of the measure time, this is
+   also the warm up; then measure batches until the time is used up. */
+void SpBench::TestBody()
+{
+    long long target = gArgBenchTime * 1000000LL;
+    long long batch = 1;
+    long long used;
+
+    for (;;) {
+        used = runBatch(batch);
+        if (used >= target/_SpBenchSamples || batch >= _SpBenchMaxBatch)
+            break;
+        if (used <= 0)
+            batch *= 10;
+        else
+            batch = std::max(batch*2, std::min(batch*10, batch*(target/_SpBenchSamples)/used + 1));
+    }
+
+    std::vector<double> tSamples;
+    {
+        SpAllocPause tPause;
+        tSamples.reserve(_SpBenchSamples);
+    }
+    used = 0;
+    while (tSamples.size()<_SpBenchSamples && (used<target || tSamples.empty())) {
+        long long t = runBatch(batch);
+        tSamples.push_back((double)t/batch);
+        used += t;
+    }
+
+    SpBenchStat tStat;
+    double sum = 0, sqsum = 0;
+    size_t n = tSamples.size();
+
+    std::sort(tSamples.begin(), tSamples.end());
+    for (size_t i=0; i<n; i++)
+        sum += tSamples[i];
+    tStat.mean = sum/n;
+    for (size_t i=0; i<n; i++)
+        sqsum += (tSamples[i]-tStat.mean)*(tSamples[i]-tStat.mean);
+
+    tStat.iterations = batch*n;
+    tStat.min = tSamples[0];
+    tStat.median = (n%2) ? tSamples[n/2] : (tSamples[n/2-1]+tSamples[n/2])/2;
+    tStat.p99 = tSamples[(n*99+99)/100-1];
+    tStat.stddev = n>1 ? sqrt(sqsum/(n-1)) : 0;
+    setBenchStat(tStat);
+}
+
+/******************************************************************************
+    Performance assertions
+******************************************************************************/
+static SpMutex  sgBaselineLock;
+
+bool Compare::CheckDurationLess(long long cost, long long limit, const char *expr,
+                                const char *file, int line)
+{
+    if (cost < limit)
+        return true;
+    SpAllocPause tPause;
+    if (!KeepFailure(file, line))
+        return false;
+
+    std::stringstream tStrStream;
+    tStrStream << file << ":" << line << " Failure" << std::endl;
+    tStrStream << "Duration of [ " << expr << " ] expect less than [ " << limit << " ns ]" << std::endl;
+    tStrStream << "Duration   = [" << cost << " ns]" << std::endl;
+    ReportFailure(tStrStream.str());
+    return false;
+}
+
+SpRegression::SpRegression(const std::string &tKey, const char *pFile, int line) :
+        pFile(pFile), line(line), tries(0), best(0), baseline(0)
+{
+    SpAllocPause tPause;
+    this->tKey = currentUnitCase ? currentUnitCase->getSuiteName()+"."+currentUnitCase->getTestName()+":"+tKey : tKey;
+
+    SpAutoLock tLock(sgBaselineLock);
+    blHasBaseline = gBaselineDB.find(this->tKey, baseline);
+}
+
+/* first measure always, retry only while it looks regressed */
+bool SpRegression::next()
+{
+    if (!tries)
+        return true;
+    if (gArgUpdateBaseline || !blHasBaseline || tries > gArgRetries)
+        return false;
+    return best*100 > baseline*(100+gArgTolerance);
+}
+
+void SpRegression::add(long long measured)
+{
+    if (!tries++ || measured < best)
+        best = measured;
+}
+
+bool SpRegression::check(const char *expr)
+{
+    SpAllocPause tPause;
+    if (gArgUpdateBaseline) {
+        SpAutoLock tLock(sgBaselineLock);
+        gBaselineDB.set(tKey, best);
+        return true;
+    }
+
+    if (!blHasBaseline) {
+        _SpWarnLog("No baseline of [ %s ], run with --update-baseline to create it.\n", tKey.c_str());
+        return true;
+    }
+
+    if (best*100 <= baseline*(100+gArgTolerance))
+        return true;
+    if (!Compare::KeepFailure(pFile, line))
+        return false;
+
+    std::stringstream tStrStream;
+    tStrStream << pFile << ":" << line << " Failure" << std::endl;
+    tStrStream << "Regression of [ " << tKey << " ], measured by [ " << expr << " ] " << tries << " times" << std::endl;
+    tStrStream << "Baseline   = [" << baseline << "], tolerance " << gArgTolerance << "%" << std::endl;
+    tStrStream << "Best       = [" << best << "]" << std::endl;
+    Compare::ReportFailure(tStrStream.str());
+    return false;
+}
+
+/******************************************************************************
+    Bulk compare
+******************************************************************************/
+/* first offset where the two buffers differ, len if none. Compare 64 bytes a
+   round with SSE2, or 8 bytes a round without, bytes only for the tail. */
+size_t Compare::MemDiff(const void *p1, const void *p2, size_t len)
+{
+    const unsigned char *s1 = (const unsigned char *)p1;
+    const unsigned char *s2 = (const unsigned char *)p2;
+    size_t i = 0;
+
+    if (s1 == s2)
+        return len;
+#ifdef __SSE2__
+    for (; i+64 <= len; i += 64) {
+        __m128i r0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s1+i)), _mm_loadu_si128((const __m128i *)(s2+i)));
+        __m128i r1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s1+i+16)), _mm_loadu_si128((const __m128i *)(s2+i+16)));
+        __m128i r2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s1+i+32)), _mm_loadu_si128((const __m128i *)(s2+i+32)));
+        __m128i r3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s1+i+48)), _mm_loadu_si128((const __m128i *)(s2+i+48)));
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(r0, r1), _mm_and_si128(r2, r3))) != 0xFFFF)
+            break;
+    }
+    for (; i+16 <= len; i += 16) {
+        __m128i r = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s1+i)), _mm_loadu_si128((const __m128i *)(s2+i)));
+        int mask = _mm_movemask_epi8(r) ^ 0xFFFF;
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#else
+    for (; i+sizeof(unsigned long long) <= len; i += sizeof(unsigned long long)) {
+        unsigned long long a, b;
+        memcpy(&a, s1+i, sizeof(a));
+        memcpy(&b, s2+i, sizeof(b));
+        if (a != b)
+            break;
+    }
+#endif
+    for (; i < len; i++)
+        if (s1[i] != s2[i])
+            return i;
+    return len;
+}
+
+static void SpHexWindow(std::ostream &os, const char *pName, const unsigned char *p, size_t start, size_t end, size_t pos)
+{
+    char aBuf[sizeof(unsigned long)*2+2];     /* every hex digit of the offset, ':' and NUL */
+
+    os << pName;
+    snprintf(aBuf, sizeof(aBuf), "%08lx:", (unsigned long)start);
+    os << aBuf;
+    for (size_t i=start; i<end; i++) {
+        snprintf(aBuf, sizeof(aBuf), i==pos ? " [%02x]" : " %02x", p[i]);
+        os << aBuf;
+    }
+    os << std::endl;
+}
+
+bool Compare::CheckMemEqu(const void *p1, const void *p2, size_t len, const char *expr1,
+                          const char *expr2, const char *file, int line)
+{
+    size_t pos = (p1 && p2) ? MemDiff(p1, p2, len) : (p1==p2 || !len ? len : 0);
+    if (pos == len)
+        return true;
+    SpAllocPause tPause;
+    if (!KeepFailure(file, line))
+        return false;
+
+    std::stringstream tStrStream;
+    tStrStream << file << ":" << line << " Failure" << std::endl;
+    tStrStream << "Expression expect [ " << expr1 << " ] equal to [ " << expr2 << " ] in " << len << " bytes" << std::endl;
+    if (!p1 || !p2) {
+        tStrStream << "Buffer     = [" << p1 << "] vs [" << p2 << "]" << std::endl;
+    } else {
+        /* the 16 bytes row of the mismatch and the row before it */
+        size_t start = pos>=16 ? (pos-16) & ~(size_t)15 : 0;
+        size_t end = len-start>32 ? start+32 : len;
+
+        tStrStream << "First mismatch at offset " << pos << std::endl;
+        SpHexWindow(tStrStream, "Left  ", (const unsigned char *)p1, start, end, pos);
+        SpHexWindow(tStrStream, "Right ", (const unsigned char *)p2, start, end, pos);
     }
 
-    pHookFunc = NULL;
-    blAlwaysRet = false;
-    retValue = 0;
-    tRetDB.clear();
-    memset(apArgRepVal, 0, sizeof(apArgRepVal));
-    memset(adwArgLen, 0, sizeof(adwArgLen));
+    ReportFailure(tStrStream.str());
+    return false;
 }
 
-void SpMockImp::hook(void *pHook)
+/******************************************************************************
+    Floating point compare
+******************************************************************************/
+/* map the sign and magnitude bits to an unsigned scale where neighbour values
+   differ by 1, so the distance of two values is their distance in ULP */
+static inline unsigned int SpBiased(float v)
 {
-    pHookFunc = pHook;
-    hookApi(pHookFunc, sgMockFuncSlot[slot]);
+    unsigned int bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits+1 : bits|0x80000000u;
 }
 
-int SpMockImp::getRet()
+static inline unsigned long long SpBiased(double v)
 {
-    if (blAlwaysRet)
-        return retValue;
+    unsigned long long bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return (bits & 0x8000000000000000ull) ? ~bits+1 : bits|0x8000000000000000ull;
+}
 
-    if (!tRetDB.size()) {
-        reset();
-        return -1;
-    }
+template <typename T>
+static inline double SpUlpDistance(T v1, T v2)
+{
+    if (v1!=v1 || v2!=v2)
+        return HUGE_VAL;
+    return (double)(SpBiased(v1)>=SpBiased(v2) ? SpBiased(v1)-SpBiased(v2) : SpBiased(v2)-SpBiased(v1));
+}
 
-    int ret = tRetDB.front();
-    tRetDB.pop_front();
-    if (!tRetDB.size())
-        reset();
-    return ret;
+template <typename T>
+static inline T SpNearError(T v1, T v2, SpNearMode mode)
+{
+    T diff = v1>v2 ? v1-v2 : v2-v1;
+    if (mode == SpNear_Abs)
+        return diff;
+    if (mode == SpNear_Rel) {
+        T a1 = v1<0 ? -v1 : v1;
+        T a2 = v2<0 ? -v2 : v2;
+        T base = a1>a2 ? a1 : a2;
+        return base>0 ? diff/base : diff;
+    }
+    return (T)SpUlpDistance(v1, v2);
 }
 
-void SpMockImp::getArg(void *p0, void *p1, void *p2, void *p3, void *p4, void *p5, void *p6, void *p7)
+static bool SpShowUlp(double v1, double v2, double dist, const char *expr1, const char *expr2,
+                      const char *file, int line)
 {
-    #define _SpFSetArg(No)  if (adwArgLen[No])   memcpy(p##No, apArgRepVal[No], adwArgLen[No])
+    SpAllocPause tPause;
+    if (!Compare::KeepFailure(file, line))
+        return false;
 
-    _SpFSetArg(0);  _SpFSetArg(1);  _SpFSetArg(2);  _SpFSetArg(3);
-    _SpFSetArg(4);  _SpFSetArg(5);  _SpFSetArg(6);  _SpFSetArg(7);
+    std::stringstream tStrStream;
+    tStrStream.precision(17);
+    tStrStream << file << ":" << line << " Failure" << std::endl;
+    tStrStream << "Expression expect [ " << expr1 << " ] almost equal to [ " << expr2 << " ] within "
+               << Compare::MaxUlps << " ULP" << std::endl;
+    tStrStream << "Expr left  = [" << v1 << "]" << std::endl;
+    tStrStream << "Expr right = [" << v2 << "]" << std::endl;
+    tStrStream << "Distance   = [" << dist << " ULP]" << std::endl;
+    Compare::ReportFailure(tStrStream.str());
+    return false;
 }
 
-bool SpMockImp::repArg(int no, void *prep, int len)
+bool Compare::CheckNear(double v1, double v2, double absError, const char *expr1, const char *expr2,
+                        const char *exprError, const char *file, int line)
 {
-    if (no>=_SpMockMaxArgs)
+    double diff = v1>v2 ? v1-v2 : v2-v1;
+    if (diff <= absError)
+        return true;
+    SpAllocPause tPause;
+    if (!KeepFailure(file, line))
         return false;
-    apArgRepVal[no] = prep;
-    adwArgLen[no] = len;
-    return true;
+
+    std::stringstream tStrStream;
+    tStrStream.precision(17);
+    tStrStream << file << ":" << line << " Failure" << std::endl;
+    tStrStream << "Difference of [ " << expr1 << " ] and [ " << expr2 << " ] expect not exceed [ " << exprError << " ]" << std::endl;
+    tStrStream << "Expr left  = [" << v1 << "]" << std::endl;
+    tStrStream << "Expr right = [" << v2 << "]" << std::endl;
+    tStrStream << "Difference = [" << diff << "], limit [" << absError << "]" << std::endl;
+    ReportFailure(tStrStream.str());
+    return false;
 }
 
-void SpMockImp::addRet(int value, int times)
+bool Compare::CheckFloatEqu(float v1, float v2, const char *expr1, const char *expr2, const char *file, int line)
 {
-    if (times == _SpMockRetAlways) {
-        retValue = value;
-        blAlwaysRet = true;
-        return;
-    }
-
-    for (int i=0; i<times; i++)
-        tRetDB.push_back(value);
+    double dist = SpUlpDistance(v1, v2);
+    return dist<=MaxUlps ? true : SpShowUlp(v1, v2, dist, expr1, expr2, file, line);
 }
 
-bool SpMockImp::hookApi(void* ApiFun, void* HookFun)
+bool Compare::CheckDoubleEqu(double v1, double v2, const char *expr1, const char *expr2, const char *file, int line)
 {
-    #ifdef __MINGW32__
-	bool    IsSuccess = FALSE;
-	DWORD   TempProtectVar=PAGE_READWRITE;
-	MEMORY_BASIC_INFORMATION MemInfo;
+    double dist = SpUlpDistance(v1, v2);
+    return dist<=MaxUlps ? true : SpShowUlp(v1, v2, dist, expr1, expr2, file, line);
+}
 
-	VirtualQuery(ApiFun,&MemInfo,sizeof(MEMORY_BASIC_INFORMATION));
-	if(VirtualProtect(MemInfo.BaseAddress,MemInfo.RegionSize,
-			TempProtectVar,&MemInfo.Protect)) {
-        memcpy(ApiBackup,(const void*)ApiFun, sizeof(ApiBackup));
-		*(BYTE*)ApiFun = FLATJMPCMD;
-#ifdef __x86_64__
-        *(unsigned long long*)((BYTE*)ApiFun + FLATJMPCMD_LENGTH) = (unsigned long long)HookFun -(unsigned long long)ApiFun - FLATJMPCODE_LENGTH;
-#else
-		*(DWORD*)((BYTE*)ApiFun + FLATJMPCMD_LENGTH) = (DWORD)HookFun -(DWORD)ApiFun - FLATJMPCODE_LENGTH;
-#endif
-		VirtualProtect(MemInfo.BaseAddress,MemInfo.RegionSize,
-				MemInfo.Protect,&TempProtectVar);
-		IsSuccess = TRUE;
-	}
-	#else
-	bool    IsSuccess = FALSE;
-	BYTE    *p;
-	p = (char *)(((long) ApiFun) & ~(PAGESIZE-1));
-	if( mprotect( p, PAGESIZE, PROT_READ|PROT_WRITE|PROT_EXEC ) == 0 )
-    {
-        memcpy(ApiBackup,(const void*)ApiFun, sizeof(ApiBackup));
-		*(BYTE*)ApiFun = FLATJMPCMD;
-		*(DWORD*)((BYTE*)ApiFun + FLATJMPCMD_LENGTH) = (DWORD)HookFun -(DWORD)ApiFun - FLATJMPCODE_LENGTH;
+/* The pass path only counts the elements out of tolerance, an integer sum
+   without branch or early exit the compiler can vectorize. Max error, mean
+   error and worst index are computed after a failure. */
+template <typename T>
+static bool SpArrayNear(const T *p1, const T *p2, size_t n, double tolerance, SpNearMode mode,
+                        const char *expr1, const char *expr2, const char *file, int line)
+{
+    T limit = (T)tolerance;
+    size_t badCount = 0;
 
-        mprotect( p, PAGESIZE, PROT_READ|PROT_EXEC);
-        IsSuccess = TRUE;
+    if (mode == SpNear_Abs) {
+        for (size_t i=0; i<n; i++) {
+            T e = p1[i]>p2[i] ? p1[i]-p2[i] : p2[i]-p1[i];
+            badCount += !(e <= limit);
+        }
+    } else {
+        for (size_t i=0; i<n; i++)
+            badCount += !(SpNearError(p1[i], p2[i], mode) <= limit);
     }
-    else
-    {
-        perror("Errno mprotect");
+    if (!badCount)
+        return true;
+    SpAllocPause tPause;
+    if (!Compare::KeepFailure(file, line))
+        return false;
+
+    size_t worst = n, first = n;
+    double sumError = 0;
+    for (size_t i=0; i<n; i++) {
+        T e = SpNearError(p1[i], p2[i], mode);
+        if (e < HUGE_VAL)
+            sumError += e;      /* NaN and infinite are left out of the mean */
+        if (first==n && !(e <= limit))
+            first = worst = i;
+        else if (first!=n && e > SpNearError(p1[worst], p2[worst], mode))
+            worst = i;
     }
-	#endif
-	return IsSuccess;
+
+    static const char *sModeName[] = { "absolute error", "relative error", "ULP" };
+    std::stringstream tStrStream;
+    tStrStream.precision(9);
+    tStrStream << file << ":" << line << " Failure" << std::endl;
+    tStrStream << "Expression expect [ " << expr1 << " ] near to [ " << expr2 << " ] by " << sModeName[mode]
+               << " [" << tolerance << "]" << std::endl;
+    tStrStream << badCount << " of " << n << " elements out of tolerance, first at index " << first << std::endl;
+    tStrStream << "Max error  = [" << SpNearError(p1[worst], p2[worst], mode) << "] at index " << worst
+               << ", mean error = [" << sumError/n << "]" << std::endl;
+    Compare::ElemWindow<true>::Show(tStrStream, "Left  ", p1, n, worst);
+    Compare::ElemWindow<true>::Show(tStrStream, "Right ", p2, n, worst);
+    Compare::ReportFailure(tStrStream.str());
+    return false;
 }
 
-bool SpMockImp::unhookApi(void* ApiFun)
+bool Compare::CheckArrayNear(const float *p1, const float *p2, size_t n, double tolerance, SpNearMode mode,
+                             const char *expr1, const char *expr2, const char *file, int line)
 {
-    #ifdef __MINGW32__
-	bool    IsSuccess = FALSE;
-	DWORD   TempProtectVar=PAGE_READWRITE;
-	MEMORY_BASIC_INFORMATION MemInfo;
-
-	VirtualQuery(ApiFun,&MemInfo,sizeof(MEMORY_BASIC_INFORMATION));
-	if(VirtualProtect(MemInfo.BaseAddress,MemInfo.RegionSize,
-			TempProtectVar,&MemInfo.Protect))	{
-	    memcpy((void*)ApiFun, ApiBackup, sizeof(ApiBackup));
-		VirtualProtect(MemInfo.BaseAddress,MemInfo.RegionSize,
-				MemInfo.Protect,&TempProtectVar);
-
-		IsSuccess = TRUE;
-	}
-    #else
-	bool    IsSuccess = FALSE;
-	BYTE    *p;
-	p = ((WORDPTR)ApiFun) & ~(PAGESIZE-1);
+    return SpArrayNear(p1, p2, n, tolerance, mode, expr1, expr2, file, line);
+}
 
-	if( mprotect( p, PAGESIZE, PROT_READ|PROT_WRITE|PROT_EXEC ) == 0 )  {
-		memcpy((void*)ApiFun, ApiBackup, sizeof(ApiBackup));
-        mprotect( p, PAGESIZE, PROT_READ|PROT_EXEC);
-        IsSuccess = TRUE;
-    }
-    #endif
-	return IsSuccess;
+bool Compare::CheckArrayNear(const double *p1, const double *p2, size_t n, double tolerance, SpNearMode mode,
+                             const char *expr1, const char *expr2, const char *file, int line)
+{
+    return SpArrayNear(p1, p2, n, tolerance, mode, expr1, expr2, file, line);
 }
 
 /******************************************************************************
-    Mocker user interface
+    Assertion sites
 ******************************************************************************/
-SpMock::SpMock(void *pFunc, bool reset)
+/* sites listed when they run first */
+static SpMutex                      sgSiteLock;
+static std::vector<SpAssertSite*>   sgSites;
+
+void SpListSite(SpAssertSite &tSite)
 {
-    pImp = SpGetMockImp(pFunc);
-    if (!pImp)
-        throw 1000;
-    if (!reset)
-        pImp->hook(pFunc);
+    SpAllocPause tPause;
+    SpAutoLock tLock(sgSiteLock);
+    if (!tSite.blListed)
+        sgSites.push_back(&tSite);
+    tSite.blListed = true;
 }
 
-SpMock &SpMock::retAlways(int value)
+#ifndef __MINGW32__
+/* bounds of the section, defined by the linker, NULL if no site is in it */
+extern "C" SpAssertSite *__start_sp_assert_sites[] __attribute__((weak));
+extern "C" SpAssertSite *__stop_sp_assert_sites[] __attribute__((weak));
+#endif
+
+/* Sorted by address, an inlined assertion has one entry for each copy */
+static void SpGetSites(std::vector<SpAssertSite*> &tSites)
 {
-    pImp->addRet(value, _SpMockRetAlways);
-    return *this;
+    SpAutoLock tLock(sgSiteLock);
+    tSites = sgSites;
+#ifndef __MINGW32__
+    if (__start_sp_assert_sites)
+        tSites.insert(tSites.end(), __start_sp_assert_sites, __stop_sp_assert_sites);
+#endif
+    std::sort(tSites.begin(), tSites.end());
+    tSites.erase(std::unique(tSites.begin(), tSites.end()), tSites.end());
 }
 
-SpMock &SpMock::retOnce(int value)
+/* file, line, comparator and expressions, the same for copies of a site in
+   inlined code and in every process */
+static std::string SpSiteKey(const SpAssertSite *p)
 {
-    pImp->addRet(value, 1);
-    return *this;
+    std::string tKey = p->pFile;
+    tKey += '\0' + int2String(p->line) + '\0' + p->pCheck + '\0' + p->pExpr1 + '\0' + p->pExpr2;
+    return tKey;
 }
 
-SpMock &SpMock::retTimes(int value, int times)
+/* Sites with their copies added up, sorted by address of the first copy */
+static void SpGetMergedSites(std::vector<SpAssertSite> &tMerged)
 {
-    pImp->addRet(value, times);
-    return *this;
+    std::vector<SpAssertSite*> tSites;
+    std::map<std::string, size_t> tIndex;
+
+    SpGetSites(tSites);
+    tMerged.clear();
+    for (size_t i=0; i<tSites.size(); i++) {
+        std::map<std::string, size_t>::iterator it = tIndex.find(SpSiteKey(tSites[i]));
+        if (it == tIndex.end()) {
+            tIndex[SpSiteKey(tSites[i])] = tMerged.size();
+            tMerged.push_back(*tSites[i]);
+        } else {
+            tMerged[it->second].passCount += tSites[i]->passCount;
+            tMerged[it->second].failCount += tSites[i]->failCount;
+        }
+    }
 }
 
-SpMock &SpMock::retRange(int valStart, int valEnd)
+static bool SpSiteByHits(const SpAssertSite *p1, const SpAssertSite *p2)
 {
-    for (int i=0; i<=valEnd; i++)
-        pImp->addRet(i, 1);
-    return *this;
+    return p1->passCount+p1->failCount > p2->passCount+p2->failCount;
 }
 
-SpMock &SpMock::repArg(int no, void *prep, int len)
+static void SpShowSite(const SpAssertSite *p, const char *pCount)
 {
-    pImp->repArg(no, prep, len);
-    return *this;
+    printf("    %-14s %s:%d %s(%s%s%s)\n", pCount, p->pFile, p->line, p->pCheck,
+           p->pExpr1, p->pExpr2[0]?", ":"", p->pExpr2);
 }
 
-/******************************************************************************
-    static Mocker implement
-******************************************************************************/
-static SpMockImp sMockImp[_SpMockSlots];
+static void SpShowSiteReport(int hottest)
+{
+    std::vector<SpAssertSite> tMerged;
+    std::vector<SpAssertSite*> tSites, tNeverRun, tFailed;
+    char abCount[32];
+    size_t i;
 
-#define _SpSemicolon     ;
-#define _SpComma         ,
-#define _SpFGen32Imp(Macro, Sep) \
-				Macro(0) Sep	Macro(1) Sep	Macro(2) Sep	Macro(3) Sep	Macro(4) Sep	Macro(5) Sep	Macro(6) Sep	Macro(7) Sep	Macro(8) Sep	Macro(9) Sep	Macro(10) Sep	Macro(11) Sep	Macro(12) Sep	Macro(13) Sep	Macro(14) Sep	Macro(15) Sep \
-                Macro(16) Sep	Macro(17) Sep	Macro(18) Sep	Macro(19) Sep	Macro(20) Sep	Macro(21) Sep	Macro(22) Sep	Macro(23) Sep	Macro(24) Sep	Macro(25) Sep	Macro(26) Sep	Macro(27) Sep	Macro(28) Sep	Macro(29) Sep	Macro(30) Sep	Macro(31) Sep
+    SpLogSync();
+    SpGetMergedSites(tMerged);
+    for (i=0; i<tMerged.size(); i++)
+        tSites.push_back(&tMerged[i]);
+    for (i=0; i<tSites.size(); i++) {
+        if (!tSites[i]->passCount && !tSites[i]->failCount)
+            tNeverRun.push_back(tSites[i]);
+        if (tSites[i]->failCount)
+            tFailed.push_back(tSites[i]);
+    }
+    std::stable_sort(tSites.begin(), tSites.end(), SpSiteByHits);
 
-#define _SpFMockFuncUse(No)         (void*)SpMockFunc##No
-#define _SpFMockFuncImp(No)         static int SpMockFunc##No(void *p0, void *p1, void *p2, void *p3, \
-                                                           void *p4, void *p5, void *p6, void *p7) { \
-                                       sMockImp[No].getArg(p0,p1,p2,p3,p4,p5,p6,p7);\
-                                       return sMockImp[No].getRet(); \
-                                    }
+    printf("\nAssertion report: %d sites, %d never run, %d failed\n",
+           (int)tSites.size(), (int)tNeverRun.size(), (int)tFailed.size());
+    printf("Never run:\n");
+    for (i=0; i<tNeverRun.size(); i++)
+        SpShowSite(tNeverRun[i], "");
+    printf("Hottest (runs):\n");
+    for (i=0; i<tSites.size() && (int)i<hottest && tSites[i]->passCount+tSites[i]->failCount; i++) {
+        sprintf(abCount, "%lld", tSites[i]->passCount+tSites[i]->failCount);
+        SpShowSite(tSites[i], abCount);
+    }
+    printf("Failed (failed/runs):\n");
+    for (i=0; i<tFailed.size(); i++) {
+        sprintf(abCount, "%lld/%lld", tFailed[i]->failCount, tFailed[i]->passCount+tFailed[i]->failCount);
+        SpShowSite(tFailed[i], abCount);
+    }
+}
 
-_SpFGen32Imp(_SpFMockFuncImp, _SpSemicolon)
-void *SpMockImp::sgMockFuncSlot[_SpMockSlots] = {
-    _SpFGen32Imp(_SpFMockFuncUse, _SpComma)
-};
+int SpUnitInit(int argc, char* argv[])
+{
+    printf("Welcome to Sparrow Unit v%d.%d\n\n", SpVersionMain, SpVersionSub);
+    SpParseArg(argc, argv);
+    SpLogInit(gArgColor);
+    sgLogQuiet = gArgQuiet;
+    sgLogOnlyFailures = gArgOnlyFailures;
+    if (gArgTimingDB.size())
+        gTimingDB.load(gArgTimingDB);
+    gBaselineDB.load(gArgBaseline);
+    SpPerfCounter::blEnabled = gArgPerfCounters;
+    sgTraceEnabled = gArgTraceFile.size() > 0;
+    sgFailMessages = gArgFailMessages;
+    sgFailInfoLimit = gArgFailInfoLimit;
+    sgFailPrintLimit = gArgFailPrintLimit;
+    sgCaseFailLimit = gArgCaseFailLimit;
+    sgCaptureEnabled = gArgCaptureOutput;
+    sgCaptureLimit = gArgCaptureLimit;
+#ifdef __MINGW32__
+    if (sgCaptureEnabled)
+        _SpWarnLog("--capture-output is not supported on Windows, it is ignored.\n");
+    sgCaptureEnabled = false;
+#endif
+    if (sgCaptureEnabled && gArgJobs > 1) {
+        _SpWarnLog("--capture-output is ignored with --jobs, output of parallel cases can't be told apart.\n");
+        sgCaptureEnabled = false;
+    }
+    sgMockWX = gArgMockWX;
+#ifndef __linux__
+    if (sgMockWX)
+        _SpWarnLog("--mock-wx is supported on Linux only, it is ignored.\n");
+    sgMockWX = false;
+#endif
+    return 0;
+}
 
-/******************************************************************************
-    Mocker slots
-******************************************************************************/
-static int MockGetSlot()
+#ifndef __MINGW32__
+/* Record: [index][record of the binary result file] */
+static void SpSendResult(int fd, int idx, const SpCaseResult &tRes)
 {
-    int iPos = __builtin_ffs(~sgMockFlag)-1;
-    if (iPos<0)
-        return _SpMockInvalidSlotId;
-    sgMockFlag |= 1<<iPos;
-    return iPos;
+    static SpMutex sLock;
+    std::string tRecord((const char *)&idx, sizeof(idx));
+
+    SpBinEncode(tRecord, tRes);
+    SpAutoLock tLock(sLock);
+    SpWriteAll(fd, tRecord.data(), tRecord.size());
 }
 
-static void MockFreeSlot(int slot)
+/* Counters of the sites that ran as a record of index -1: for each site its
+   key length, key, pass and fail count. Sites are found by key in parent,
+   the shard may have listed sites the parent has not. */
+static void SpSendSiteCounts(int fd)
 {
-    if (slot >= _SpMockSlots) {
-        _SpWarnLog("MockFreeSlot: invalid slot %d, shoule between 0 and %d.\n", slot, _SpMockSlots-1);
-        return;
+    std::vector<SpAssertSite> tSites;
+    SpCaseResult tRes;
+
+    SpGetMergedSites(tSites);
+    for (size_t i=0; i<tSites.size(); i++) {
+        if (!tSites[i].passCount && !tSites[i].failCount)
+            continue;
+        std::string tKey = SpSiteKey(&tSites[i]);
+        int len = (int)tKey.size();
+        tRes.tFailInfo.append((const char *)&len, sizeof(len));
+        tRes.tFailInfo += tKey;
+        tRes.tFailInfo.append((const char *)&tSites[i].passCount, sizeof(long long));
+        tRes.tFailInfo.append((const char *)&tSites[i].failCount, sizeof(long long));
     }
-    sgMockFlag &= ~(1<<slot);
+    SpSendResult(fd, -1, tRes);
 }
 
-static SpMockImp *SpGetMockImp(void *pFunc)
+/* Add the counts of a shard to the sites of the same key */
+static void SpAddSiteCounts(const std::string &tData)
 {
-    int slot = _SpMockInvalidSlotId;
-    for (int i=0; i<_SpMockSlots; i++)
-        if (sMockImp[i].match(pFunc)) {
-            slot = i;
+    std::vector<SpAssertSite*> tSites;
+    std::map<std::string, SpAssertSite*> tIndex;
+    size_t pos = 0;
+    int len;
+
+    SpGetSites(tSites);
+    for (size_t i=0; i<tSites.size(); i++)
+        if (!tIndex.count(SpSiteKey(tSites[i])))
+            tIndex[SpSiteKey(tSites[i])] = tSites[i];
+
+    while (pos+sizeof(len) <= tData.size()) {
+        memcpy(&len, tData.data()+pos, sizeof(len));
+        pos += sizeof(len);
+        if (len < 0 || pos+len+2*sizeof(long long) > tData.size())
             break;
+        std::string tKey = tData.substr(pos, len);
+        long long aCount[2];
+        memcpy(aCount, tData.data()+pos+len, sizeof(aCount));
+        pos += len + sizeof(aCount);
+
+        SpAssertSite *pSite = tIndex[tKey];
+        if (!pSite) {
+            /* listed when it ran in the shard only, keep a copy of the key
+               for the strings of a new site */
+            char *pKey = new char[tKey.size()+1];
+            memcpy(pKey, tKey.c_str(), tKey.size()+1);
+            char *pLine = pKey + strlen(pKey) + 1;
+            char *pCheck = pLine + strlen(pLine) + 1;
+            char *pExpr1 = pCheck + strlen(pCheck) + 1;
+            char *pExpr2 = pExpr1 + strlen(pExpr1) + 1;
+            pSite = new SpAssertSite;
+            pSite->pFile = pKey;
+            pSite->line = atoi(pLine);
+            pSite->pCheck = pCheck;
+            pSite->pExpr1 = pExpr1;
+            pSite->pExpr2 = pExpr2;
+            pSite->passCount = pSite->failCount = 0;
+            pSite->blListed = false;
+            SpListSite(*pSite);
+            tIndex[tKey] = pSite;
         }
+        pSite->passCount += aCount[0];
+        pSite->failCount += aCount[1];
+    }
+}
+#endif
 
-    if (slot==_SpMockInvalidSlotId)
-        slot = MockGetSlot();
-    if (slot==_SpMockInvalidSlotId)
-        return NULL;
+struct SpRunQueue {
+    std::vector<SpCaseInfo*>    cases;
+    std::vector<SpCaseResult>   results;
+    std::vector<int>            order;      /* index of cases to run */
+    int                         next;
+    bool                        blBuffered;
+    int                         resultFd;   /* fork shard: pipe to parent */
+    SpXmlWriter                 *pXml;
+    SpBinWriter                 *pBin;
+};
 
-    sMockImp[slot].reset();
-    sMockImp[slot].setSlot(slot);
-    return &sMockImp[slot];
+/* Write the finished case to the result files */
+static void SpCaseDone(SpRunQueue &tQueue, int idx)
+{
+    /* before the xml writer, which may free the failure messages */
+    if (tQueue.pBin)
+        tQueue.pBin->add(tQueue.results[idx]);
+    if (tQueue.pXml)
+        tQueue.pXml->done(idx);
 }
 
-void SpMockReset(void *pFunc)
+static void SpRunWorker(void *arg)
 {
-    for (int i=0; i<_SpMockSlots; i++)
-        if (sMockImp[i].match(pFunc))
-            sMockImp[i].reset();
+    SpRunQueue *pQueue = (SpRunQueue *)arg;
+    SpLogBuf tLog(pQueue->blBuffered);
+    SpLogBuf *pPrevLog = sgLogBuf;
+
+    SpLogSync();
+    sgLogBuf = &tLog;
+    for (;;) {
+        int pos = __sync_fetch_and_add(&pQueue->next, 1);
+        if (pos >= (int)pQueue->order.size())
+            break;
+
+        /* the case object is deleted here, the trace keeps the names of its descriptor */
+        int idx = pQueue->order[pos];
+        const SpCaseInfo *pInfo = pQueue->cases[idx];
+        long long tStart = SpGetWallTime();
+        SpUnit *pCase = pInfo->pCreate();
+        pCase->runTest();
+        pQueue->results[idx].collect(pCase);
+        delete pCase;
+        SpTraceAdd(pInfo->pSuite, pInfo->pName, "case", tStart, SpGetWallTime()-tStart);
+#ifndef __MINGW32__
+        if (pQueue->resultFd >= 0)
+            SpSendResult(pQueue->resultFd, idx, pQueue->results[idx]);
+#endif
+        SpCaseDone(*pQueue, idx);
+    }
+    SpPerfCounter::closeThread();
+    SpLogFlush(tLog);
+    sgLogBuf = pPrevLog;
 }
 
-void SpMockResetAll()
+static std::string SpCaseKey(const SpCaseInfo *p)
 {
-    for (int i=0; i<_SpMockSlots; i++)
-        sMockImp[i].reset();
+    return std::string(p->pSuite) + "." + p->pName;
 }
 
-/******************************************************************************
-    Sparrow User interface
-******************************************************************************/
-static bool gArgShowHelp = false;
-static bool gArgShowCaseList = false;
-static std::string  gArgFilter;
-static std::string  gArgXmlFile;
-
-static void SpParseArg(int argc, char **argv)
+/* Longest case first, so a long case never starts at the end of a parallel run */
+static void SpSortByTime(const SpRunQueue &tQueue, std::vector<int> &tOrder)
 {
-#define _SpParseSwitchArg(pStr, arg, set)      {\
-                    if (!strcmp(argv[dwCurArg], (char *)(pStr))) { \
-                        arg = set; \
-                    }}
-#define _SpParseComplxArg(pStr, arg, func)      {\
-                    if (!strncmp(argv[dwCurArg], (char *)(pStr), strlen(pStr))) { \
-                        arg = func(&argv[dwCurArg][strlen(pStr)+1]); \
-                    }}
+    std::vector<std::pair<long long,size_t> > tSort;
+    for (size_t i=0; i<tOrder.size(); i++)
+        tSort.push_back(std::pair<long long,size_t>(-gTimingDB.get(SpCaseKey(tQueue.cases[tOrder[i]])), i));
+    std::sort(tSort.begin(), tSort.end());
 
-    int dwCurArg = 1;
-    while(dwCurArg < argc) {
-        _SpParseSwitchArg("--help",                 gArgShowHelp,       true);
-        _SpParseSwitchArg("--gtest_list_tests",     gArgShowCaseList,   true);
-        _SpParseComplxArg("--vague-match",          gArgFilter,         std::string);
-        _SpParseComplxArg("--gtest_output=xml",     gArgXmlFile,        std::string);
-        dwCurArg++;
-    }
+    std::vector<int> tSorted;
+    for (size_t i=0; i<tSort.size(); i++)
+        tSorted.push_back(tOrder[tSort[i].second]);
+    tOrder.swap(tSorted);
 }
 
-static void SpShowHelp()
+static void SpRunQueueCases(SpRunQueue &tQueue, bool blBuffered)
 {
-    const char    *pUsage =
-    "Help Options:\n"
-    "    --help                     Print this help\n"
-    "    --gtest_list_tests         Show test case list\n"
-    "    --vague-match=FILTER       Run test case that can vague match\n"
-    "    --gtest_output=xml:FILE    Write result to xml file\n"
-    "\n";
-    printf(pUsage);
+    if (gArgJobs>1 && !gTimingDB.empty())
+        SpSortByTime(tQueue, tQueue.order);
+
+    tQueue.next = 0;
+    tQueue.blBuffered = blBuffered || gArgJobs>1;
+    SpCaptureStart();
+    SpRunThreads(gArgJobs>1?gArgJobs:1, SpRunWorker, &tQueue);
+    SpCaptureStop();
 }
-static void SpShowCaseList()
+
+/******************************************************************************
+    Fork shards
+******************************************************************************/
+#ifndef __MINGW32__
+/* Parse whole records from tData, returns bytes consumed */
+static size_t SpRecvResult(const std::string &tData, SpRunQueue &tQueue, std::vector<bool> &tDone)
 {
-    std::vector<SpUnit*>::iterator it = spudb->cases.begin();
-    printf("Test case list: \n");
-    for (; it!=spudb->cases.end(); it++)
-        printf("    %s\n", (*it)->getTestName().c_str());
+    size_t pos = 0;
+    int idx;
+
+    while (tData.size()-pos > sizeof(idx)) {
+        SpCaseResult tRes;
+        size_t len = SpBinDecode(tData.data()+pos+sizeof(idx), tData.size()-pos-sizeof(idx), tRes);
+        if (!len)
+            break;
+        memcpy(&idx, tData.data()+pos, sizeof(idx));
+
+        if (idx == -1) {
+            SpAddSiteCounts(tRes.tFailInfo);
+        } else if (idx>=0 && idx<(int)tQueue.results.size()) {
+            tQueue.results[idx] = tRes;
+            tDone[idx] = true;
+            SpCaseDone(tQueue, idx);
+        }
+        pos += sizeof(idx) + len;
+    }
+    return pos;
 }
 
-static bool SpPreprocess()
+static void SpRunForkShards(SpRunQueue &tQueue, int shards)
 {
-#define _SpCheckFlagAndCall(flag, call)   if (flag) {call();return false;}
+    std::vector<pid_t>          tPids;
+    std::vector<struct pollfd>  tFds;
+    std::vector<std::string>    tPending;
+    std::vector<bool>           tDone(tQueue.cases.size(), false);
+    std::vector<int>            tAll = tQueue.order;
+    std::vector<std::vector<int> >  tShards(shards);
+    std::vector<long long>      tShardTime(shards, 0);
+    int i;
 
-    _SpCheckFlagAndCall(gArgShowHelp, SpShowHelp);
-    _SpCheckFlagAndCall(gArgShowCaseList, SpShowCaseList);
+    /* Give each case, longest first, to the shard with least expected time */
+    SpSortByTime(tQueue, tAll);
+    for (i=0; i<(int)tAll.size(); i++) {
+        int iMin = std::min_element(tShardTime.begin(), tShardTime.end()) - tShardTime.begin();
+        tShards[iMin].push_back(tAll[i]);
+        tShardTime[iMin] += gTimingDB.get(SpCaseKey(tQueue.cases[tAll[i]])) + 1;
+    }
 
-    return true;
+    SpLogSync();
+    fflush(stdout);
+    for (i=0; i<shards; i++) {
+        int fd[2];
+        if (pipe(fd))
+            break;
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fd[0]);
+            close(fd[1]);
+            break;
+        }
+
+        if (!pid) {
+            close(fd[0]);
+            for (size_t j=0; j<tFds.size(); j++)
+                close(tFds[j].fd);
+
+            /* events of parent are written by parent */
+            for (size_t j=0; j<sgTraceBufs.size(); j++)
+                sgTraceBufs[j]->count = 0;
+
+            tQueue.order = tShards[i];
+            tQueue.resultFd = fd[1];
+            tQueue.pXml = NULL;
+            tQueue.pBin = NULL;
+            SpRunQueueCases(tQueue, true);
+            if (gArgAssertionReport)
+                SpSendSiteCounts(fd[1]);
+            if (sgTraceEnabled)
+                SpTraceWriteShard(SpTraceShardFile(gArgTraceFile, i));
+            SpLogFlushMain();
+            fflush(stdout);
+            _exit(0);
+        }
+
+        close(fd[1]);
+        struct pollfd tPoll = { fd[0], POLLIN, 0 };
+        if (sgTraceEnabled)
+            sgTraceShardFiles.push_back(SpTraceShardFile(gArgTraceFile, i));
+        tPids.push_back(pid);
+        tFds.push_back(tPoll);
+        tPending.push_back(std::string());
+    }
+
+    if (!tPids.size()) {
+        _SpWarnLog("Fork shards failed, run all cases in current process.\n");
+        SpRunQueueCases(tQueue, false);
+        return;
+    }
+    if ((int)tPids.size() < shards)
+        _SpWarnLog("Only %d of %d shards started.\n", (int)tPids.size(), shards);
+
+    size_t alive = tFds.size();
+    while (alive) {
+        if (poll(&tFds[0], tFds.size(), -1) < 0)
+            continue;
+
+        for (size_t j=0; j<tFds.size(); j++) {
+            if (tFds[j].fd<0 || !tFds[j].revents)
+                continue;
+
+            char abBuf[4096];
+            ssize_t len = read(tFds[j].fd, abBuf, sizeof(abBuf));
+            if (len > 0) {
+                tPending[j].append(abBuf, len);
+                tPending[j].erase(0, SpRecvResult(tPending[j], tQueue, tDone));
+                continue;
+            }
+
+            close(tFds[j].fd);
+            tFds[j].fd = -1;
+            alive--;
+        }
+    }
+
+    for (i=0; i<(int)tPids.size(); i++)
+        waitpid(tPids[i], NULL, 0);
+
+    /* cases of a crashed shard, or of a shard that never started */
+    for (i=0; i<(int)tAll.size(); i++) {
+        if (tDone[tAll[i]])
+            continue;
+        SpCaseResult &tRes = tQueue.results[tAll[i]];
+        tRes.failCount = 1;
+        tRes.tFailInfo = "Shard process exited before the case finished.\n";
+        SpCaseDone(tQueue, tAll[i]);
+        _SpErrorLog("[     FAIL ] %s.%s (no result from shard process)\n",
+                    tQueue.cases[tAll[i]]->pSuite, tQueue.cases[tAll[i]]->pName);
+    }
 }
+#endif
 
-int SpUnitInit(int argc, char* argv[])
+/******************************************************************************
+    Merge results, no case is run
+******************************************************************************/
+static int SpMergeResults()
 {
-    printf("Welcome to Sparrow Unit v%d.%d\n\n", SpVersionMain, SpVersionSub);
-    SpParseArg(argc, argv);
-    return 0;
+    std::vector<SpCaseResult> tResults;
+    std::string tList = gArgMergeFiles + ",";
+    int iFiles = 0, iFailed = 0;
+    size_t i, pos, end;
+
+    for (pos=0; (end=tList.find(',', pos))!=std::string::npos; pos=end+1)
+        if (end>pos && SpBinLoad(tList.substr(pos, end-pos), tResults))
+            iFiles++;
+
+    for (i=0; i<tResults.size(); i++)
+        if (tResults[i].failCount)
+            iFailed++;
+
+    /* json first, the xml writer frees failure messages */
+    if (gArgJsonFile.size())
+        SpJsonSave(gArgJsonFile, tResults);
+    if (gArgBinFile.size()) {
+        SpBinWriter tBin;
+        if (tBin.open(gArgBinFile))
+            for (i=0; i<tResults.size(); i++)
+                tBin.add(tResults[i]);
+    }
+    if (gArgXmlFile.size()) {
+        SpXmlWriter tXml;
+        /* the first case is written first, done in reverse writes all at once */
+        if (tXml.open(gArgXmlFile, tResults, true))
+            for (i=tResults.size(); i>0; i--)
+                tXml.done(i-1);
+    }
+
+    SpUnitPrintf(iFailed?ColorType_Red:ColorType_Green, "[==========] Merged %d files, all case %d, success %d, failed %d.\n",
+            iFiles, (int)tResults.size(), (int)tResults.size()-iFailed, iFailed);
+    SpLogSync();
+    return iFailed;
 }
 
 int SpUnitRunAll(void)
 {
     if (!SpPreprocess())
         return 0;
+    if (gArgMergeFiles.size())
+        return SpMergeResults();
 
-    int iRetFinal = 0;
+    SpRunQueue tQueue;
+    SpXmlWriter tXml;
+    SpBinWriter tBin;
     size_t i;
-    int iCounter = 0;
 
-    for (i=0; i<spudb->env.size(); i++)
-        spudb->env[i]->SetUp();
+    tQueue.resultFd = -1;
+    SpSelectCases(tQueue.cases);
+    tQueue.results.resize(tQueue.cases.size());
+    for (i=0; i<tQueue.cases.size(); i++) {
+        tQueue.order.push_back(i);
+        tQueue.results[i].tSuiteName = tQueue.cases[i]->pSuite;
+        tQueue.results[i].tCaseName = tQueue.cases[i]->pName;
+    }
+    tQueue.pXml = NULL;
+    tQueue.pBin = NULL;
+    if (gArgXmlFile.size() && tXml.open(gArgXmlFile, tQueue.results, gArgJsonFile.empty()))
+        tQueue.pXml = &tXml;
+    if (gArgBinFile.size() && tBin.open(gArgBinFile))
+        tQueue.pBin = &tBin;
 
-    std::vector<SpUnit*>::iterator it = spudb->cases.begin();
-    for (; it!=spudb->cases.end(); it++) {
-        if (!(*it)->isMatch(gArgFilter))
-            continue;
+    SPUDB *pDB = SpGetDB();
+    for (i=0; i<pDB->env.size(); i++) {
+        long long tStart = SpGetWallTime();
+        pDB->env[i]->SetUp();
+        SpTraceAdd(NULL, "Environment SetUp", "environment", tStart, SpGetWallTime()-tStart);
+    }
 
-        iCounter++;
-        if ((*it)->runTest())
-            iRetFinal++;
+#ifndef __MINGW32__
+    /* baseline is updated in memory, run in this process to keep it */
+    if (gArgForkShards > 1 && gArgUpdateBaseline)
+        _SpWarnLog("--update-baseline is set, --fork-shards is ignored.\n");
+    if (gArgForkShards > 1 && !gArgUpdateBaseline)
+        SpRunForkShards(tQueue, gArgForkShards);
+    else
+#endif
+        SpRunQueueCases(tQueue, false);
+
+    for (i=0; i<pDB->env.size(); i++) {
+        long long tStart = SpGetWallTime();
+        pDB->env[i]->TearDown();
+        SpTraceAdd(NULL, "Environment TearDown", "environment", tStart, SpGetWallTime()-tStart);
     }
 
-    for (i=0; i<spudb->env.size(); i++)
-        spudb->env[i]->TearDown();
+    int iCounter = tQueue.cases.size();
+    int iRetFinal = 0;
+    for (i=0; i<tQueue.results.size(); i++)
+        if (tQueue.results[i].failCount)
+            iRetFinal++;
 
     ColorType tColor = ColorType_Green;
     if (iRetFinal)
@@ -770,11 +4201,132 @@ int SpUnitRunAll(void)
 
     SpUnitPrintf(tColor, "\n[==========] All case %d, success %d, failed %d.\n",
             iCounter, iCounter-iRetFinal, iRetFinal);
+    if (gArgAssertionReport)
+        SpShowSiteReport(10);
 
-    if (gArgXmlFile.size())
-        SpStat::getStat().writeFile(gArgXmlFile);
+    tXml.close();
+    tBin.close();
+    if (gArgJsonFile.size())
+        SpJsonSave(gArgJsonFile, tQueue.results);
 
+    if (gArgTimingDB.size()) {
+        for (i=0; i<tQueue.cases.size(); i++)
+            gTimingDB.set(SpCaseKey(tQueue.cases[i]), tQueue.results[i].tTiming.totalWall());
+        gTimingDB.save(gArgTimingDB);
+    }
+
+    if (gArgUpdateBaseline)
+        gBaselineDB.save(gArgBaseline);
+
+    if (sgTraceEnabled)
+        SpTraceSave(gArgTraceFile);
+
+    SpLogSync();
     return iRetFinal;
 }
 
 }
+
+/******************************************************************************
+    Allocation hooks
+******************************************************************************/
+#if defined(SP_ALLOC_TRACK) && defined(__GLIBC__)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+void  __libc_free(void *p);
+
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+    SparrowUnit::SpAllocAdd(p);
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p = __libc_calloc(n, size);
+    SparrowUnit::SpAllocAdd(p);
+    return p;
+}
+
+void *realloc(void *p, size_t size)
+{
+    void *pNew = __libc_realloc(p, size);
+    if (pNew || !size) {
+        SparrowUnit::SpAllocDel(p);
+        SparrowUnit::SpAllocAdd(pNew);
+    }
+    return pNew;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *p = __libc_memalign(align, size);
+    SparrowUnit::SpAllocAdd(p);
+    return p;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+int posix_memalign(void **pp, size_t align, size_t size)
+{
+    if (!align || (align & (align-1)) || align % sizeof(void *))
+        return EINVAL;
+    *pp = memalign(align, size);
+    return *pp ? 0 : ENOMEM;
+}
+
+void *valloc(size_t size)
+{
+    void *p = __libc_valloc(size);
+    SparrowUnit::SpAllocAdd(p);
+    return p;
+}
+
+void *pvalloc(size_t size)
+{
+    void *p = __libc_pvalloc(size);
+    SparrowUnit::SpAllocAdd(p);
+    return p;
+}
+
+void free(void *p)
+{
+    SparrowUnit::SpAllocDel(p);
+    __libc_free(p);
+}
+}
+#elif defined(SP_ALLOC_TRACK)
+void *operator new(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    SparrowUnit::SpAllocAdd(p);
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) throw()
+{
+    SparrowUnit::SpAllocDel(p);
+    free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+    operator delete(p);
+}
+#endif